@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Common.hpp"
+#include "ThreadCache.hpp"
+#include "CentralCache.hpp"
+#include "PageCache.hpp"
+#include <sstream>
+#include <iomanip>
+
+// 获取内存池各层的统计信息
+// 各层平时只维护自己的计数，这里逐层加锁汇总，适合按需调用，不要放在热路径上
+static inline AllocatorStats GetAllocatorStats()
+{
+	AllocatorStats stats;
+	for (size_t i = 0; i < N_FREELISTS; ++i)
+	{
+		stats._classes[i]._objSize = SizeClass::IndexToSize(i);
+	}
+
+	ThreadCache::GetStats(stats);
+	for (size_t node = 0; node < NumaTopology::GetInstance()->NumNodes(); ++node)
+	{
+		CentralCache::GetInstance(node)->GetStats(stats);
+	}
+
+	PageCache::GetInstance()->GetStats(stats);
+
+	return stats;
+}
+
+// 把统计信息格式化成可读的文本，只输出有span的size class
+// 碎片率 = central cache持有的span中没有被应用使用的字节占比（含各级缓存和span中的空闲内存块）
+static inline std::string DumpAllocatorStats(const AllocatorStats& stats)
+{
+	std::ostringstream out;
+	const double MB = 1024.0 * 1024.0;
+
+	size_t threadBytes = 0, remoteBytes = 0, transferBytes = 0, centralFreeBytes = 0, centralBytes = 0;
+	for (size_t i = 0; i < N_FREELISTS; ++i)
+	{
+		const SizeClassStats& cls = stats._classes[i];
+		threadBytes += cls._threadCacheObjs * cls._objSize;
+		remoteBytes += cls._remoteFreeObjs * cls._objSize;
+		transferBytes += cls._transferCacheObjs * cls._objSize;
+		centralFreeBytes += cls._centralFreeObjs * cls._objSize;
+		centralBytes += cls._centralPages << PAGE_SHIFT;
+	}
+	size_t pageCacheBytes = stats._pageCachePages << PAGE_SHIFT;
+	size_t releasedBytes = stats._pageCacheReleasedPages << PAGE_SHIFT;
+	size_t systemBytes = stats._systemPages << PAGE_SHIFT;
+
+	out << std::fixed << std::setprecision(1);
+	out << "------------------------------------------------------------\n";
+	out << "从操作系统申请的内存:     " << std::setw(10) << systemBytes / MB << " MB\n";
+	out << "thread cache缓存:         " << std::setw(10) << threadBytes / MB << " MB (" << stats._threadCaches << "个)\n";
+#ifdef CMP_REMOTE_FREE
+	out << "  其中等着交还给owner:    " << std::setw(10) << remoteBytes / MB << " MB\n";
+#endif
+	out << "transfer cache缓存:       " << std::setw(10) << transferBytes / MB << " MB\n";
+	out << "central cache span空闲:   " << std::setw(10) << centralFreeBytes / MB << " MB\n";
+	out << "central cache span总计:   " << std::setw(10) << centralBytes / MB << " MB\n";
+	out << "page cache空闲:           " << std::setw(10) << pageCacheBytes / MB << " MB (" << stats._pageCacheSpans << "个span)\n";
+	out << "page cache已归还给系统:   " << std::setw(10) << releasedBytes / MB << " MB\n";
+	out << "------------------------------------------------------------\n";
+	out << " class    size   spans   pages  in-use  thread  transfer  central  frag%   fetch  overflow\n";
+
+	for (size_t i = 0; i < N_FREELISTS; ++i)
+	{
+		const SizeClassStats& cls = stats._classes[i];
+		if (cls._centralSpans == 0) continue;
+
+		size_t cached = cls._threadCacheObjs + cls._transferCacheObjs;
+		size_t inUse = cls._centralUsedObjs > cached ? cls._centralUsedObjs - cached : 0;
+		size_t spanBytes = cls._centralPages << PAGE_SHIFT;
+		double frag = 100.0 * (1.0 - (double)(inUse * cls._objSize) / (double)spanBytes);
+
+		out << std::setw(6) << i << std::setw(8) << cls._objSize
+			<< std::setw(8) << cls._centralSpans << std::setw(8) << cls._centralPages
+			<< std::setw(8) << inUse << std::setw(8) << cls._threadCacheObjs
+			<< std::setw(10) << cls._transferCacheObjs << std::setw(9) << cls._centralFreeObjs
+			<< std::setw(7) << frag << std::setw(8) << cls._fetchCount
+			<< std::setw(10) << cls._overflowCount << "\n";
+	}
+
+	return out.str();
+}
\ No newline at end of file
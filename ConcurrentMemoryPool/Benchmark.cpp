@@ -1,118 +1,584 @@
 #include "ConcurrentAlloc.hpp"
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 
-// ntimes -- 一轮申请释放内存的次数
-// rounds -- 轮次
-void BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds)
+// 分配器基准测试（Linux）
+// 每个场景分别用glibc malloc和内存池各跑一次，每次都在fork出的子进程中运行，两者的峰值RSS互不影响
+// 耗时都按墙上时间统计：clock()统计的是进程所有线程的CPU时间之和，线程数越多越偏离实际耗时
+// 用法：./benchmark [线程数] [每个线程的操作次数] [场景名]，场景名为空时运行所有场景
+
+// 被测的分配器
+struct Allocator
+{
+	const char* _name;
+	void* (*_alloc)(size_t);
+	void (*_free)(void*);
+};
+
+static void* PoolAlloc(size_t size) { return ConcurrentAlloc(size); }
+static void PoolFree(void* ptr) { ConcurrentFree(ptr); }
+
+static const Allocator ALLOCATORS[] = {
+	{ "glibc malloc", malloc, free },
+	{ "ConcurrentAlloc", PoolAlloc, PoolFree },
+};
+
+static uint64_t NowNs()
 {
-	std::vector<std::thread> vthread(nworks);
-	std::atomic<size_t> malloc_costtime = 0;
-	std::atomic<size_t> free_costtime = 0;
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// xorshift64，比std::mt19937轻，不会让随机数的开销盖过一次分配
+struct Random
+{
+	uint64_t _state;
 
-	for (size_t k = 0; k < nworks; ++k)
+	explicit Random(uint64_t seed) :_state(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+
+	uint64_t Next()
 	{
-		vthread[k] = std::thread([&, k]() {
-			std::vector<void*> v;
-			v.reserve(ntimes);
+		_state ^= _state << 13;
+		_state ^= _state >> 7;
+		_state ^= _state << 17;
+		return _state;
+	}
 
-			for (size_t j = 0; j < rounds; ++j)
-			{
-				size_t begin1 = clock();
-				for (size_t i = 0; i < ntimes; i++)
-				{
-					//v.push_back(malloc(16));
-					v.push_back(malloc((16 + i) % 8192 + 1));
-				}
-				size_t end1 = clock();
+	// [lo, hi]中的随机数
+	size_t Range(size_t lo, size_t hi) { return lo + Next() % (hi - lo + 1); }
+};
 
-				size_t begin2 = clock();
-				for (size_t i = 0; i < ntimes; i++)
-				{
-					free(v[i]);
-				}
-				size_t end2 = clock();
-				v.clear();
+// 每个线程一个，负责调用分配器并抽样记录单次操作的延迟
+// 每SAMPLE_INTERVAL次操作计时一次，避免读时钟的开销拖慢整体吞吐；记录的延迟里包含一次读时钟的开销（几十ns），两种分配器相同
+static const size_t SAMPLE_INTERVAL = 16;
+
+class OpTimer
+{
+public:
+	OpTimer(const Allocator& alloc, size_t expectedOps)
+		:_alloc(alloc)
+	{
+		_samples.reserve(expectedOps / SAMPLE_INTERVAL + 64);
+	}
 
-				malloc_costtime += (end1 - begin1);
-				free_costtime += (end2 - begin2);
+	// 申请的内存写入首字节，和真实程序一样让页面真正被使用
+	void* Alloc(size_t size)
+	{
+		void* ptr;
+		if (++_ops % SAMPLE_INTERVAL != 0)
+		{
+			ptr = _alloc._alloc(size);
+		}
+		else
+		{
+			uint64_t begin = NowNs();
+			ptr = _alloc._alloc(size);
+			_samples.push_back((uint32_t)std::min<uint64_t>(NowNs() - begin, UINT32_MAX));
+		}
+
+		*(char*)ptr = 1;
+		return ptr;
+	}
+
+	void Free(void* ptr)
+	{
+		if (++_ops % SAMPLE_INTERVAL != 0)
+		{
+			_alloc._free(ptr);
+			return;
+		}
+
+		uint64_t begin = NowNs();
+		_alloc._free(ptr);
+		_samples.push_back((uint32_t)std::min<uint64_t>(NowNs() - begin, UINT32_MAX));
+	}
+
+	size_t Ops() { return _ops; }
+
+	std::vector<uint32_t>& Samples() { return _samples; }
+
+private:
+	const Allocator& _alloc;
+	size_t _ops = 0;
+	std::vector<uint32_t> _samples;
+};
+
+// 一次运行的结果，由子进程通过管道交给父进程
+struct CaseResult
+{
+	size_t _ops;
+	uint64_t _wallNs;
+	uint32_t _p50;
+	uint32_t _p99;
+	size_t _peakRssKB;
+};
+
+// 启动nThreads个线程执行work(tid, timer)，所有线程就绪后才同时开始，统计从开始到全部结束的墙上时间
+template<class Work>
+static CaseResult RunThreads(const Allocator& alloc, size_t nThreads, size_t opsPerThread, Work work)
+{
+	std::vector<OpTimer> timers;
+	timers.reserve(nThreads);
+	for (size_t i = 0; i < nThreads; ++i)
+	{
+		timers.emplace_back(alloc, opsPerThread);
+	}
+
+	std::atomic<size_t> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<std::thread> vthread(nThreads);
+	for (size_t k = 0; k < nThreads; ++k)
+	{
+		vthread[k] = std::thread([&, k]() {
+			++ready;
+			while (!go.load(std::memory_order_acquire))
+			{
+				std::this_thread::yield();
 			}
+			work(k, timers[k]);
 			});
 	}
 
+	while (ready.load() != nThreads)
+	{
+		std::this_thread::yield();
+	}
+	uint64_t begin = NowNs();
+	go.store(true, std::memory_order_release);
+
 	for (auto& t : vthread)
 	{
 		t.join();
 	}
+	uint64_t end = NowNs();
 
-	size_t malloc_costtime_val = malloc_costtime.load();
-	size_t free_costtime_val = free_costtime.load();
+	CaseResult result = {};
+	result._wallNs = end - begin;
 
-	printf("%u个线程并发执行%u轮次，每轮次malloc %u次: 花费：%u ms\n", nworks, rounds, ntimes, malloc_costtime_val);
+	std::vector<uint32_t> samples;
+	for (auto& timer : timers)
+	{
+		result._ops += timer.Ops();
+		samples.insert(samples.end(), timer.Samples().begin(), timer.Samples().end());
+	}
 
-	printf("%u个线程并发执行%u轮次，每轮次free %u次: 花费：%u ms\n", nworks, rounds, ntimes, free_costtime_val);
+	if (!samples.empty())
+	{
+		std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+		result._p50 = samples[samples.size() / 2];
+		std::nth_element(samples.begin(), samples.begin() + samples.size() * 99 / 100, samples.end());
+		result._p99 = samples[samples.size() * 99 / 100];
+	}
 
-	printf("%u个线程并发malloc&free %u次，总计花费：%u ms\n", nworks, nworks * rounds * ntimes, malloc_costtime_val + free_costtime_val);
+	return result;
 }
 
-// 单轮次申请释放次数 线程数 轮次
-void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds)
+// 场景1：生产者/消费者，线程两两配对，生产者申请的内存通过环形队列交给消费者释放
+// 消费者释放的都是别的线程申请的内存，测试跨线程释放
+static const size_t RING_SIZE = 1024;
+
+struct Ring
 {
-	std::vector<std::thread> vthread(nworks);
-	std::atomic<size_t> malloc_costtime = 0;
-	std::atomic<size_t> free_costtime = 0;
+	alignas(64) std::atomic<size_t> _head{ 0 }; // 消费者读取的位置
+	alignas(64) std::atomic<size_t> _tail{ 0 }; // 生产者写入的位置
+	void* _slots[RING_SIZE];
+};
 
-	for (size_t k = 0; k < nworks; ++k)
-	{
-		vthread[k] = std::thread([&]() {
-			std::vector<void*> v;
-			v.reserve(ntimes);
+static CaseResult ProducerConsumer(const Allocator& alloc, size_t nThreads, size_t ops)
+{
+	nThreads = std::max<size_t>(nThreads / 2 * 2, 2);
+	std::vector<Ring> rings(nThreads / 2);
+
+	return RunThreads(alloc, nThreads, ops, [&](size_t tid, OpTimer& timer) {
+		Ring& ring = rings[tid / 2];
 
-			for (size_t j = 0; j < rounds; ++j)
+		if (tid % 2 == 0)
+		{
+			Random rand(tid);
+			for (size_t i = 0; i < ops / 2; ++i)
 			{
-				size_t begin1 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+				void* ptr = timer.Alloc(rand.Range(16, 512));
+
+				size_t tail = ring._tail.load(std::memory_order_relaxed);
+				while (tail - ring._head.load(std::memory_order_acquire) == RING_SIZE)
 				{
-					//v.push_back(ConcurrentAlloc(16));
-					v.push_back(ConcurrentAlloc((16 + i) % 8192 + 1));
+					std::this_thread::yield();
 				}
-				size_t end1 = clock();
+				ring._slots[tail % RING_SIZE] = ptr;
+				ring._tail.store(tail + 1, std::memory_order_release);
+			}
+		}
+		else
+		{
+			for (size_t i = 0; i < ops / 2; ++i)
+			{
+				size_t head = ring._head.load(std::memory_order_relaxed);
+				while (ring._tail.load(std::memory_order_acquire) == head)
+				{
+					std::this_thread::yield();
+				}
+				void* ptr = ring._slots[head % RING_SIZE];
+				ring._head.store(head + 1, std::memory_order_release);
+
+				timer.Free(ptr);
+			}
+		}
+		});
+}
+
+// 场景2：随机生命周期，每次随机选一个槽位，空的就申请、有对象就释放，对象存活时间随机
+// 大小以256B以内为主，夹杂少量几KB和上百KB的对象
+static CaseResult RandomLifetime(const Allocator& alloc, size_t nThreads, size_t ops)
+{
+	return RunThreads(alloc, nThreads, ops, [&](size_t tid, OpTimer& timer) {
+		Random rand(tid + 100);
+		std::vector<void*> slots(4096, nullptr);
+
+		for (size_t i = 0; i < ops; ++i)
+		{
+			void*& slot = slots[rand.Next() % slots.size()];
+			if (slot)
+			{
+				timer.Free(slot);
+				slot = nullptr;
+				continue;
+			}
+
+			size_t r = rand.Next() % 100;
+			size_t size = r < 80 ? rand.Range(1, 256) : r < 98 ? rand.Range(257, 4096) : rand.Range(4097, 256 * 1024);
+			slot = timer.Alloc(size);
+		}
+
+		for (void* ptr : slots)
+		{
+			if (ptr) timer.Free(ptr);
+		}
+		});
+}
+
+// 场景3：TcpServer的大小分布
+// 下表是http服务器（http/main.cc）处理GET /hello、POST /login和静态页面请求时malloc的大小及次数，共900个请求，
+// 去掉了出现次数不到万分之一的大小；1、2字节的申请来自HttpContext解析请求时使用的std::regex
+static const size_t TCP_SERVER_SIZES[][2] = {
+	{ 1, 459900 }, { 2, 459000 }, { 24, 22537 }, { 32, 11787 }, { 80, 7870 }, { 8, 6390 }, { 31, 4200 }, { 104, 3017 },
+	{ 64, 2978 }, { 1024, 2724 }, { 192, 2704 }, { 160, 2400 }, { 96, 2104 }, { 40, 1802 }, { 15, 1801 }, { 288, 1800 },
+	{ 513, 1500 }, { 48, 968 }, { 16, 925 }, { 768, 904 }, { 504, 904 }, { 384, 904 }, { 72, 902 }, { 6144, 900 },
+	{ 480, 900 }, { 3072, 900 }, { 1936, 900 }, { 1536, 900 }, { 409, 600 }, { 34, 600 }, { 472, 307 }, { 8192, 300 },
+	{ 50, 300 }, { 325, 300 }, { 264, 282 }, { 179, 282 }, { 207, 266 }, { 122, 266 }, { 206, 246 }, { 121, 246 },
+	{ 263, 240 }, { 178, 240 }, { 37, 201 }, { 36, 92 }, { 205, 78 }, { 120, 78 }, { 262, 72 }, { 177, 72 },
+};
+
+// 每个线程保留最近申请的512个对象，新申请一个就释放最早的一个，模拟请求处理中大量短生命周期的对象
+static CaseResult TcpServerSizes(const Allocator& alloc, size_t nThreads, size_t ops)
+{
+	const size_t nSizes = sizeof(TCP_SERVER_SIZES) / sizeof(TCP_SERVER_SIZES[0]);
+	std::vector<size_t> cumulative(nSizes);
+	size_t total = 0;
+	for (size_t i = 0; i < nSizes; ++i)
+	{
+		total += TCP_SERVER_SIZES[i][1];
+		cumulative[i] = total;
+	}
+
+	return RunThreads(alloc, nThreads, ops, [&](size_t tid, OpTimer& timer) {
+		Random rand(tid + 200);
+		std::vector<void*> window(512, nullptr);
+
+		for (size_t i = 0; i < ops / 2; ++i)
+		{
+			size_t k = std::upper_bound(cumulative.begin(), cumulative.end(), rand.Next() % total) - cumulative.begin();
+
+			void*& slot = window[i % window.size()];
+			if (slot) timer.Free(slot);
+			slot = timer.Alloc(TCP_SERVER_SIZES[k][0]);
+		}
+
+		for (void* ptr : window)
+		{
+			if (ptr) timer.Free(ptr);
+		}
+		});
+}
 
-				size_t begin2 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+// 场景4：larson，模拟服务器的内存周转
+// 每个线程持有一组对象，随机替换其中的一个；一代线程运行一段时间后退出，由新线程接手它的对象继续替换，
+// 所以对象大多是被申请它的线程之后的另一个线程释放的
+static CaseResult Larson(const Allocator& alloc, size_t nThreads, size_t ops)
+{
+	const size_t generations = 8;
+
+	return RunThreads(alloc, nThreads, ops, [&](size_t tid, OpTimer& timer) {
+		std::vector<void*> slots(1000, nullptr);
+		Random rand(tid + 300);
+
+		for (size_t g = 0; g < generations; ++g)
+		{
+			// 上一代线程join之后再启动下一代，timer和slots同一时刻只有一个线程使用
+			std::thread([&]() {
+				for (size_t i = 0; i < ops / generations / 2; ++i)
 				{
-					ConcurrentFree(v[i]);
+					void*& slot = slots[rand.Next() % slots.size()];
+					if (slot) timer.Free(slot);
+					slot = timer.Alloc(rand.Range(10, 1000));
 				}
-				size_t end2 = clock();
-				v.clear();
+				}).join();
+		}
+
+		for (void* ptr : slots)
+		{
+			if (ptr) timer.Free(ptr);
+		}
+		});
+}
 
-				malloc_costtime += (end1 - begin1);
-				free_costtime += (end2 - begin2);
+// 场景5：大对象，64KB~1MB，跨过thread cache的上限MAX_BYTES
+// 申请后每页写一个字节，和真实程序一样让所有页都被使用
+static CaseResult LargeObjects(const Allocator& alloc, size_t nThreads, size_t ops)
+{
+	ops = std::max<size_t>(ops / 256, 64);
+
+	return RunThreads(alloc, nThreads, ops, [&](size_t tid, OpTimer& timer) {
+		Random rand(tid + 400);
+		std::vector<void*> slots(16, nullptr);
+
+		for (size_t i = 0; i < ops / 2; ++i)
+		{
+			void*& slot = slots[rand.Next() % slots.size()];
+			if (slot) timer.Free(slot);
+
+			size_t size = rand.Range(64 * 1024, 1024 * 1024);
+			slot = timer.Alloc(size);
+			for (size_t off = 4096; off < size; off += 4096)
+			{
+				((char*)slot)[off] = 1;
 			}
-			});
+		}
+
+		for (void* ptr : slots)
+		{
+			if (ptr) timer.Free(ptr);
+		}
+		});
+}
+
+// 场景6：大量短生命周期线程，每个线程申请释放1000次后退出
+// 每线程缓存模式下每个新线程都要创建自己的ThreadCache，每CPU缓存模式下缓存数量只和核数相关
+static CaseResult ShortLivedThreads(const Allocator& alloc, size_t nThreads, size_t ops)
+{
+	const size_t ntimes = 1000;
+
+	return RunThreads(alloc, nThreads, ops, [&](size_t, OpTimer& timer) {
+		for (size_t w = 0; w < std::max<size_t>(ops / ntimes / 2, 1); ++w)
+		{
+			std::thread([&]() {
+				void* v[ntimes];
+				for (size_t i = 0; i < ntimes; ++i)
+				{
+					v[i] = timer.Alloc((16 + i) % 8192 + 1);
+				}
+				for (size_t i = 0; i < ntimes; ++i)
+				{
+					timer.Free(v[i]);
+				}
+				}).join();
+		}
+		});
+}
+
+struct BenchCase
+{
+	const char* _key;
+	const char* _desc;
+	CaseResult (*_run)(const Allocator&, size_t, size_t);
+};
+
+static const BenchCase CASES[] = {
+	{ "prodcons", "生产者/消费者跨线程释放", ProducerConsumer },
+	{ "random", "随机生命周期", RandomLifetime },
+	{ "tcpserver", "TcpServer大小分布", TcpServerSizes },
+	{ "larson", "larson服务器周转", Larson },
+	{ "large", "大对象(64KB~1MB)", LargeObjects },
+	{ "shortlived", "短生命周期线程", ShortLivedThreads },
+};
+
+// 读取/proc/self/status中的一项，单位KB
+static size_t ReadProcStatus(const char* key)
+{
+	FILE* fp = fopen("/proc/self/status", "r");
+	if (fp == nullptr) return 0;
+
+	char line[256];
+	size_t value = 0;
+	size_t keyLen = strlen(key);
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (strncmp(line, key, keyLen) == 0 && line[keyLen] == ':')
+		{
+			value = strtoull(line + keyLen + 1, nullptr, 10);
+			break;
+		}
 	}
+	fclose(fp);
 
-	for (auto& t : vthread)
+	return value;
+}
+
+// 在子进程中运行一个场景，子进程异常退出时返回false
+static bool RunIsolated(const BenchCase& bench, const Allocator& alloc, size_t nThreads, size_t ops, CaseResult& result)
+{
+	int fds[2];
+	if (pipe(fds) != 0) return false;
+
+	pid_t pid = fork();
+	if (pid == 0)
 	{
-		t.join();
+		close(fds[0]);
+
+		// 把峰值RSS重置为当前RSS，去掉从父进程继承来的部分（Linux 4.0及以上支持）
+		int fd = open("/proc/self/clear_refs", O_WRONLY);
+		if (fd >= 0)
+		{
+			ssize_t ret = write(fd, "5", 1);
+			(void)ret;
+			close(fd);
+		}
+
+		CaseResult res = bench._run(alloc, nThreads, ops);
+		res._peakRssKB = ReadProcStatus("VmHWM");
+
+		ssize_t ret = write(fds[1], &res, sizeof(res));
+		(void)ret;
+		_exit(0);
+	}
+	close(fds[1]);
+
+	ssize_t n = pid > 0 ? read(fds[0], &result, sizeof(result)) : -1;
+	close(fds[0]);
+
+	int status = 0;
+	if (pid > 0) waitpid(pid, &status, 0);
+
+	return n == (ssize_t)sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// 改成查表之前的Index()：逐个区间比较再做移位计算，用来和查表对比
+static size_t CascadeIndex(size_t bytes)
+{
+	static int group_array[4] = { 16, 56, 56, 56 };
+
+	auto _Index = [](size_t bytes, size_t align_shift) { return ((bytes + (1 << align_shift) - 1) >> align_shift) - 1; };
+
+	if (bytes <= 128)
+	{
+		return _Index(bytes, 3);
+	}
+	else if (bytes <= 1024)
+	{
+		return _Index(bytes - 128, 4) + group_array[0];
+	}
+	else if (bytes <= 8 * 1024)
+	{
+		return _Index(bytes - 1024, 7) + group_array[0] + group_array[1];
+	}
+	else if (bytes <= 64 * 1024)
+	{
+		return _Index(bytes - 8 * 1024, 10) + group_array[0] + group_array[1] + group_array[2];
+	}
+	else
+	{
+		return _Index(bytes - 64 * 1024, 13) + group_array[0] + group_array[1] + group_array[2] + group_array[3];
+	}
+}
+
+// 大小到自由链表桶的映射：区间判断 vs 编译期生成的查找表
+// 大小按伪随机顺序取值，避免分支预测器记住固定的区间
+static void BenchmarkSizeClass(size_t ntimes)
+{
+	std::vector<size_t> sizes(4096);
+	uint32_t seed = 12345;
+	for (auto& size : sizes)
+	{
+		seed = seed * 1103515245 + 12345;
+		size_t r = seed >> 8;
+		size = r % 4 == 0 ? r % MAX_BYTES + 1 : r % 1024 + 1; // 大部分是1KB以内的小对象
 	}
 
-	size_t malloc_costtime_val = malloc_costtime.load();
-	size_t free_costtime_val = free_costtime.load();
+	volatile size_t sink = 0; // 防止计算结果被编译器优化掉
+	size_t sum = 0;
+
+	auto begin1 = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < ntimes; ++i)
+	{
+		sum += CascadeIndex(sizes[i & 4095]);
+	}
+	auto end1 = std::chrono::steady_clock::now();
+	sink = sum;
 
-	printf("%u个线程并发执行%u轮次，每轮次concurrent alloc %u次: 花费：%u ms\n", nworks, rounds, ntimes, malloc_costtime_val);
+	sum = 0;
+	auto begin2 = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < ntimes; ++i)
+	{
+		sum += SizeClass::Index(sizes[i & 4095]);
+	}
+	auto end2 = std::chrono::steady_clock::now();
+	sink = sum;
+	(void)sink;
 
-	printf("%u个线程并发执行%u轮次，每轮次concurrent dealloc %u次: 花费：%u ms\n", nworks, rounds, ntimes, free_costtime_val);
+	long long cost1 = std::chrono::duration_cast<std::chrono::microseconds>(end1 - begin1).count();
+	long long cost2 = std::chrono::duration_cast<std::chrono::microseconds>(end2 - begin2).count();
 
-	printf("%u个线程并发concurrent alloc&dealloc %u次，总计花费：%u ms\n", nworks, nworks * rounds * ntimes, malloc_costtime_val + free_costtime_val);
+	printf("size class映射%zu次：区间判断花费：%lld us，查表花费：%lld us\n", ntimes, cost1, cost2);
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-	size_t n = 10000;
+	size_t nThreads = argc > 1 ? strtoull(argv[1], nullptr, 10) : 4;
+	size_t ops = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1000000;
+	std::string filter = argc > 3 ? argv[3] : "";
+	nThreads = std::max<size_t>(nThreads, 1);
+
 	std::cout << "==========================================================" << std::endl;
-	BenchmarkConcurrentMalloc(n, 4, 10);
-	std::cout << std::endl << std::endl;
+	// 子进程中检测rseq，父进程不使用内存池
+#ifdef CMP_PER_CPU_CACHE
+	std::cout << "缓存模式：每CPU缓存（rseq不可用时退回每线程缓存）" << std::endl;
+#else
+	std::cout << "缓存模式：每线程缓存" << std::endl;
+#endif
+#ifdef CMP_HARDENED
+	std::cout << "加固模式：开启（和benchmark的结果对比即为加固的开销）" << std::endl;
+#endif
+	printf("%zu个线程，每个线程%zu次操作（申请和释放各算一次），延迟每%zu次操作抽样一次\n", nThreads, ops, SAMPLE_INTERVAL);
 
-	BenchmarkMalloc(n, 4, 10);
+	for (const BenchCase& bench : CASES)
+	{
+		if (!filter.empty() && filter != bench._key) continue;
+
+		printf("\n[%s] %s\n", bench._key, bench._desc);
+		printf("  %-16s %12s %10s %10s %12s\n", "allocator", "Mops/s", "p50(ns)", "p99(ns)", "peakRSS(MB)");
+
+		for (const Allocator& alloc : ALLOCATORS)
+		{
+			CaseResult result;
+			if (!RunIsolated(bench, alloc, nThreads, ops, result))
+			{
+				printf("  %-16s 运行失败\n", alloc._name);
+				continue;
+			}
+
+			printf("  %-16s %12.2f %10u %10u %12.1f\n", alloc._name,
+				result._ops * 1e3 / std::max<uint64_t>(result._wallNs, 1),
+				result._p50, result._p99, result._peakRssKB / 1024.0);
+		}
+	}
+
+	if (filter.empty() || filter == "sizeclass")
+	{
+		std::cout << std::endl;
+		BenchmarkSizeClass(100000000);
+	}
 	std::cout << "==========================================================" << std::endl;
 
 	return 0;
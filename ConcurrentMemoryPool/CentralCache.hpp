@@ -2,41 +2,78 @@
 
 #include "Common.hpp"
 #include "PageCache.hpp"
+#include "TransferCache.hpp"
+#include "Numa.hpp"
 
-// 单例模式--饿汉模式
+// 每个NUMA节点一个central cache，从本节点的page cache分片申请span，线程只和自己所在节点的central cache交互
+// 单例模式--懒汉模式
 class CentralCache
 {
 public:
-	// 获取central cache的单例对象
-	static CentralCache* GetInstance() { return &_singleInstance; }
+	// 获取node节点的central cache对象
+	static CentralCache* GetInstance(size_t node = 0)
+	{
+		// 同PageCache，第一次使用时为所有节点构造，永不析构
+		alignas(CentralCache) static char storage[MAX_NUMA_NODES][sizeof(CentralCache)];
+		static bool init = [] {
+			for (size_t i = 0; i < NumaTopology::GetInstance()->NumNodes(); ++i)
+			{
+				new(storage[i])CentralCache(i);
+			}
+			return true;
+		}();
+		(void)init;
+
+		assert(node < NumaTopology::GetInstance()->NumNodes());
+		return (CentralCache*)storage[node];
+	}
 
-	// 获取一个非空的span
+	// 获取一个非空的span，向page cache申请失败时返回nullptr，返回时都持有桶锁
 	Span* GetOneSpan(SpanList& spanList, size_t size)
 	{
-		// 查看当前spanlist中是否存在_freeList不为空的span对象
-		Span* it = spanList.Begin();
-		while (it != spanList.End())
+		// 分配完的span已经移到了_fullSpans中，spanlist中的span都还有空闲内存块，取第一个即可
+		if (!spanList.Empty())
 		{
-			if (it->_freeList != nullptr)
-			{
-				return it;
-			}
-			else
-			{
-				it = it->_next;
-			}
+			return spanList.Begin();
 		}
 
 		// 先将central cache中的spanlist的桶锁解锁，这样其他的线程在归还内存给这个spanlist的话就不会因为拿不到锁资源而阻塞
 		spanList.GetMutex().unlock();
 
 		// 代码执行到这里说明，当前spanlist中没有空闲的span了，需要向page cache申请span对象
-		PageCache::GetInstance()->GetMutex().lock(); // page cache整体锁加锁
-		Span* span = PageCache::GetInstance()->GetSpan(SizeClass::NumMovePage(size));
-		span->_isUse = true; // 从page cache中申请到的span置为使用状态
-		span->_objSize = size; // 设置span下挂的小内存块的大小
-		PageCache::GetInstance()->GetMutex().unlock(); // page cache整体锁解锁
+		// 从本节点的page cache分片申请，page cache在分片锁内把span置为使用状态
+		Span* span = PageCache::GetInstance()->GetSpan(SizeClass::NumMovePage(size), _node);
+		if (span == nullptr)
+		{
+			spanList.GetMutex().lock();
+			return nullptr;
+		}
 
+		span->_objSize = size; // 设置span下挂的小内存块的大小
+		span->_node = _node;   // 记录span属于哪个节点的central cache，小块内存归还时据此找回
+#ifdef CMP_REMOTE_FREE
+		span->_owner.store(nullptr, std::memory_order_relaxed); // span对象可能被复用过，清掉之前的owner
+#endif
+#ifdef CMP_HARDENED
+		for (auto& bits : span->_allocBits) bits.store(0, std::memory_order_relaxed);
+#endif
+#if defined(CMP_SPAN_BITMAP) || defined(CMP_HARDENED)
+		// 位图按MAX_SPAN_OBJECTS个内存块定长分配，span的页数（NumMovePage）变大时这里会先失败，而不是越界写位图
+		assert((span->_nPages << PAGE_SHIFT) / size <= MAX_SPAN_OBJECTS);
+#endif
+
+#ifdef CMP_SPAN_BITMAP
+		// 位图格式不切割内存，只把前capacity个内存块标记为空闲（span末尾不足一个对象大小的部分不算）
+		size_t capacity = (span->_nPages << PAGE_SHIFT) / size;
+		for (size_t w = 0; w < SPAN_BITMAP_WORDS; ++w)
+		{
+			size_t first = w << 6;
+			if (first + 64 <= capacity) span->_freeBits[w] = ~(uint64_t)0;
+			else if (first < capacity) span->_freeBits[w] = ((uint64_t)1 << (capacity - first)) - 1;
+			else span->_freeBits[w] = 0;
+		}
+		span->_freeCount = capacity;
+#else
 		// 计算span的大块内存的起始地址和大块内存的的字节数
 		char* start = (char*)(span->_pageId << PAGE_SHIFT);
 		size_t bytes = span->_nPages << PAGE_SHIFT;
@@ -48,8 +85,8 @@ public:
 		start += size;
 		void* tail = span->_freeList;
 
-		// 2. 将后面的内存切成小块尾插到_freeList中
-		while (start < end)
+		// 2. 将后面的内存切成小块尾插到_freeList中（span末尾不足一个对象大小的部分不切）
+		while (start + size <= end)
 		{
 			NextObj(tail) = start;
 			tail = NextObj(tail);
@@ -57,6 +94,7 @@ public:
 			start += size;
 		}
 		NextObj(tail) = nullptr;
+#endif
 
 		// 从page cache申请到的span要头插到当前的spanlist中，此过程对central cache中的spanlist操作，桶锁加锁保护
 		spanList.GetMutex().lock();
@@ -65,19 +103,60 @@ public:
 		return span;
 	}
 
-	// 从central cache获取一定数量的内存对象给thread cache
+	// 从central cache获取一定数量的内存对象给thread cache，内存不足时返回0
 	size_t FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t size)
 	{
 		// 计算要获取的内存大小映射到哪个自由链表桶
 		size_t index = SizeClass::Index(size);
 
+		// 优先从transfer cache中拿其他线程归还的内存块，不用加桶锁，拿到的可能比batchNum少
+		size_t transferNum = _transferCache[index].Remove(start, end, batchNum);
+		if (transferNum > 0)
+		{
+			return transferNum;
+		}
+
 		_spanListBucket[index].GetMutex().lock(); // 桶锁加锁
 
 		// 获取一个span
 		Span* span = GetOneSpan(_spanListBucket[index], size);
-		assert(span);
-		assert(span->_freeList);
+		if (span == nullptr)
+		{
+			_spanListBucket[index].GetMutex().unlock();
+			return 0;
+		}
+		assert(HasFreeObj(span));
+
+#ifdef CMP_SPAN_BITMAP
+		// 按位扫描取出batchNum个空闲内存块，不够则有多少取多少
+		// 只读span中的位图，不读内存块；thread cache的自由链表仍然穿过内存块，所以交出去的这一批内存块
+		// 要在这里写入链表指针。省掉的是切分span时把整个span串成链表，以及span中剩下的内存块一直不被访问
+		char* base = (char*)(span->_pageId << PAGE_SHIFT);
+		void* head = nullptr;
+		void* tail = nullptr;
+		size_t actualNum = 0;
+		for (size_t w = 0; w < SPAN_BITMAP_WORDS && actualNum < batchNum; ++w)
+		{
+			uint64_t bits = span->_freeBits[w];
+			while (bits != 0 && actualNum < batchNum)
+			{
+				void* obj = base + ((w << 6) + CountTrailingZeros(bits)) * size;
+				bits &= bits - 1; // 清除最低位的1
+
+				if (tail) NextObj(tail) = obj;
+				else head = obj;
+				tail = obj;
+				++actualNum;
+			}
+			span->_freeBits[w] = bits;
+		}
+		NextObj(tail) = nullptr;
 
+		start = head;
+		end = tail;
+		span->_freeCount -= actualNum;
+		span->_useCount += actualNum;
+#else
 		// 在span中取batchNum个内存块，若span下挂的内存块不够batchNum个，则有多少取多少
 		start = span->_freeList;
 		end = start;
@@ -93,62 +172,188 @@ public:
 		span->_freeList = NextObj(end);
 		NextObj(end) = nullptr;
 		span->_useCount += actualNum;
+#endif
+
+		// span分配完了就移到_fullSpans中，之后获取span时不用再跳过它
+		if (!HasFreeObj(span))
+		{
+			_spanListBucket[index].Erase(span);
+			_fullSpans[index].PushFront(span);
+		}
 
 		_spanListBucket[index].GetMutex().unlock(); // 桶锁解锁
 
 		return actualNum;
 	}
 
+	// thread cache归还一批内存块（不超过一整批），优先放入transfer cache，放不下再归还给span
+	// 线程可能被调度到别的节点上，一批内存块都属于同一个节点时放入那个节点的transfer cache，
+	// 混有多个节点的内存块时直接归还给各自的span，transfer cache中的内存块总是属于本节点
+	void ReleaseRangeObj(void* start, void* end, size_t n, size_t size)
+	{
+		size_t index = SizeClass::Index(size);
+
+		CentralCache* owner = this;
+		if (NumaTopology::GetInstance()->NumNodes() > 1)
+		{
+			owner = GetInstance(PageCache::GetInstance()->MapObjToSpan(start)->_node);
+			for (void* it = NextObj(start); it != nullptr && owner != nullptr; it = NextObj(it))
+			{
+				if (PageCache::GetInstance()->MapObjToSpan(it)->_node != owner->_node) owner = nullptr;
+			}
+		}
+
+		if (owner != nullptr && owner->_transferCache[index].Insert(start, end, n, size)) return;
+
+		ReleaseListToSpans(start, size);
+	}
+
+	// 把所有transfer cache中缓存的内存块归还给span，内存块全部归还的span再归还给page cache
+	// ConcurrentReleaseFreeMemory在归还物理页之前调用，否则这些span一直被transfer cache占着，物理页无法归还
+	void Drain()
+	{
+		for (size_t i = 0; i < N_FREELISTS; ++i)
+		{
+			size_t size = SizeClass::IndexToSize(i);
+			void* start = nullptr;
+			void* end = nullptr;
+			while (_transferCache[i].Remove(start, end, SizeClass::NumMoveSize(size)) > 0)
+			{
+				ReleaseListToSpans(start, size);
+			}
+		}
+	}
+
 	// 将批量的小内存块归还给central cache中对应的spanList的span
 	// （这里函数名以Spans命名，因为归还回来的小内存块可能会过多，要归还到多个span中）
+	// 线程可能被调度到别的节点上，归还的内存块不一定属于这个节点，每个内存块都归还到它的span所属节点的桶中
 	void ReleaseListToSpans(void* start, size_t size)
 	{
 		size_t index = SizeClass::Index(size);
 
-		_spanListBucket[index].GetMutex().lock(); // 桶锁加锁
+		SpanList* spanList = &_spanListBucket[index];
+		spanList->GetMutex().lock(); // 桶锁加锁
 
 		while (start)
 		{
 			void* next = NextObj(start);
 
-			// 找到start对应的span，将start指向的小内存块头插到span中freeList管理的自由链表中
+			// 找到start对应的span，span属于别的节点时换成那个节点的桶锁
 			Span* span = PageCache::GetInstance()->MapObjToSpan(start);
+			CentralCache* owner = GetInstance(span->_node);
+			if (&owner->_spanListBucket[index] != spanList)
+			{
+				spanList->GetMutex().unlock();
+				spanList = &owner->_spanListBucket[index];
+				spanList->GetMutex().lock();
+			}
+
+			// 分配完的span归还了内存块，从_fullSpans移回spanlist
+			if (!HasFreeObj(span))
+			{
+				owner->_fullSpans[index].Erase(span);
+				spanList->PushFront(span);
+			}
+
+#ifdef CMP_SPAN_BITMAP
+			// 在位图中把start对应的位重新置为空闲
+			size_t bit = ((char*)start - (char*)(span->_pageId << PAGE_SHIFT)) / span->_objSize;
+			span->_freeBits[bit >> 6] |= (uint64_t)1 << (bit & 63);
+			++span->_freeCount;
+#else
+			// 将start指向的小内存块头插到span中freeList管理的自由链表中
 			NextObj(start) = span->_freeList;
 			span->_freeList = start;
+#endif
 			--span->_useCount; // 每归还一个小内存块就要对span的_useCount减减
 
 			// 当span的_useCount等于0，说明该span切割的小内存已经全部归还回来了
 			// 可以将该span归还给page cache，page cache可以尝试去做前后页合并
 			if (span->_useCount == 0)
 			{
-				_spanListBucket[index].Erase(span);
+				spanList->Erase(span);
 				span->_freeList = nullptr;
 				span->_prev = nullptr;
 				span->_next = nullptr;
 
-				_spanListBucket[index].GetMutex().unlock();
+				spanList->GetMutex().unlock();
 
-				PageCache::GetInstance()->GetMutex().lock();
 				PageCache::GetInstance()->ReleaseSpanToPageCache(span); // 将span归还给page cache
-				PageCache::GetInstance()->GetMutex().unlock();
 
-				_spanListBucket[index].GetMutex().lock();
+				spanList->GetMutex().lock();
 			}
 
 			start = next;
 		}
 
-		_spanListBucket[index].GetMutex().unlock(); // 桶锁解锁
+		spanList->GetMutex().unlock(); // 桶锁解锁
+	}
+
+	// 汇总central cache和transfer cache的统计信息，逐个桶加锁遍历span
+	void GetStats(AllocatorStats& stats)
+	{
+		for (size_t i = 0; i < N_FREELISTS; ++i)
+		{
+			SizeClassStats& cls = stats._classes[i];
+			size_t size = SizeClass::IndexToSize(i);
+			cls._transferCacheObjs += _transferCache[i].Size();
+
+			std::lock_guard<std::mutex> lock(_spanListBucket[i].GetMutex());
+			for (SpanList* list : { &_spanListBucket[i], &_fullSpans[i] })
+			{
+				for (Span* it = list->Begin(); it != list->End(); it = it->_next)
+				{
+					size_t capacity = (it->_nPages << PAGE_SHIFT) / size;
+					++cls._centralSpans;
+					cls._centralPages += it->_nPages;
+					cls._centralUsedObjs += it->_useCount;
+					cls._centralFreeObjs += capacity - it->_useCount;
+				}
+			}
+		}
+	}
+
+	// fork前加上所有桶锁和transfer cache的锁，fork后在父子进程中解锁
+	// 正常运行时桶锁和transfer cache的锁都不会嵌套，按下标依次加锁不会和其他线程形成环
+	void LockAll()
+	{
+		for (size_t i = 0; i < N_FREELISTS; ++i)
+		{
+			_spanListBucket[i].GetMutex().lock();
+			_transferCache[i].Lock();
+		}
+	}
+
+	void UnlockAll()
+	{
+		for (size_t i = N_FREELISTS; i-- > 0;)
+		{
+			_transferCache[i].Unlock();
+			_spanListBucket[i].GetMutex().unlock();
+		}
 	}
 
 private:
-	SpanList _spanListBucket[N_FREELISTS]; // 自由链表桶
+	// span中是否还有可以分配的内存块
+	static bool HasFreeObj(Span* span)
+	{
+#ifdef CMP_SPAN_BITMAP
+		return span->_freeCount > 0;
+#else
+		return span->_freeList != nullptr;
+#endif
+	}
 
 private:
-	CentralCache() {}
+	SpanList _spanListBucket[N_FREELISTS];       // 自由链表桶，只挂还有空闲内存块的span
+	SpanList _fullSpans[N_FREELISTS];            // 内存块已经全部分配出去的span，由同下标_spanListBucket的桶锁保护
+	TransferCache _transferCache[N_FREELISTS];   // 每个size class的transfer cache
+	size_t _node = 0;                            // 所属的NUMA节点
 
-	CentralCache(const CentralCache&) = delete;
+private:
+	CentralCache(size_t node)
+		:_node(node)
+	{}
 
-	static CentralCache _singleInstance;
-};
-CentralCache CentralCache::_singleInstance;
\ No newline at end of file
+	CentralCache(const CentralCache&) = delete;
+};
\ No newline at end of file
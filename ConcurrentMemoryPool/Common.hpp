@@ -2,44 +2,257 @@
 
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <vector>
 #include <mutex>
 #include <unordered_map>
-#include <Windows.h>
 #include <cstdlib>
 #include <new>
 #include <algorithm>
 #include <atomic>
 #include <thread>
+#include <chrono>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 
 static const size_t MAX_BYTES = 256 * 1024; // thread cache中最大可申请的内存为256KB
 static const size_t N_FREELISTS = 208;      // 哈希桶的自由链表个数
 static const size_t N_PAGES = 129;          // page cache中页数的上限，[0, 128]
 static const size_t PAGE_SHIFT = 13;        // 一个页的大小为2^13byte，即8KB
+static const size_t MAX_ALLOC_BYTES = SIZE_MAX >> 2; // 单次申请的上限，超过时直接失败，保证按页取整、加canary和保护页时不会溢出
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024; // x86-64上透明大页的大小，2MB
 
 #ifdef _WIN64
 typedef unsigned long long PAGE_ID;
 #elif _WIN32
 typedef size_t PAGE_ID;
+#elif defined(__x86_64__) || defined(__aarch64__)
+typedef unsigned long long PAGE_ID;
+#else
+typedef size_t PAGE_ID;
+#endif
+
+// 定义CMP_USE_HUGEPAGE后，page cache向系统申请的大块内存会尝试使用2MB大页，减少大堆上的TLB miss
+#ifdef CMP_USE_HUGEPAGE
+static const size_t SYSTEM_ALLOC_PAGES = HUGE_PAGE_SIZE >> PAGE_SHIFT; // page cache一次向系统申请的页数，256页
+#else
+static const size_t SYSTEM_ALLOC_PAGES = N_PAGES - 1;                  // page cache一次向系统申请的页数，128页
 #endif
 
-// 直接去堆上按页申请空间
+#ifdef _WIN32
+// 直接去堆上按页申请空间，失败返回nullptr
+// 调用方可能持有内存池的锁，这里不能抛异常：替换了malloc后，抛异常时申请异常对象会重入内存池
 inline static void* SystemAlloc(size_t nPages)
 {
-	void* ptr = VirtualAlloc(0, nPages << 13, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-	if (ptr == nullptr) throw std::bad_alloc();
-
-	return ptr;
+	return VirtualAlloc(0, nPages << PAGE_SHIFT, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 }
 
 // 释放在堆上申请的空间
-inline static void SystemFree(void* ptr)
+inline static void SystemFree(void* ptr, size_t nPages)
 {
 	VirtualFree(ptr, 0, MEM_RELEASE);
 }
 
+// 把空闲页的物理内存还给操作系统，保留虚拟地址
+inline static void SystemRelease(void* ptr, size_t nPages)
+{
+	VirtualFree(ptr, nPages << PAGE_SHIFT, MEM_DECOMMIT);
+}
+
+// 设置页是否可以访问，用于大块内存的保护页
+inline static void SystemProtect(void* ptr, size_t nPages, bool accessible)
+{
+	DWORD old;
+	VirtualProtect(ptr, nPages << PAGE_SHIFT, accessible ? PAGE_READWRITE : PAGE_NOACCESS, &old);
+}
+
+// 重新提交之前通过SystemRelease归还的页
+// 调用方持有分片锁并且正在合并或切分span，失败时无法回退也不能抛异常，同TCMalloc直接终止进程
+inline static void SystemCommit(void* ptr, size_t nPages)
+{
+	if (VirtualAlloc(ptr, nPages << PAGE_SHIFT, MEM_COMMIT, PAGE_READWRITE) == nullptr) abort();
+}
+#else
+// 映射bytes字节的匿名内存，并保证起始地址按align对齐，失败返回nullptr
+// mmap只保证4KB对齐，而页号按2^PAGE_SHIFT计算，所以多映射align字节再把首尾多余的部分解除映射
+inline static void* SystemMapAligned(size_t bytes, size_t align)
+{
+	size_t mapBytes = bytes + align;
+	if (mapBytes < bytes) return nullptr;
+
+	char* raw = (char*)mmap(nullptr, mapBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == (char*)MAP_FAILED) return nullptr;
+
+	char* aligned = (char*)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+	if (aligned > raw) munmap(raw, aligned - raw);
+	size_t tail = (raw + mapBytes) - (aligned + bytes);
+	if (tail > 0) munmap(aligned + bytes, tail);
+
+	return aligned;
+}
+
+// 通过mmap按页申请匿名内存，失败返回nullptr
+// 调用方可能持有内存池的锁，这里不能抛异常：替换了malloc后，抛异常时申请异常对象会重入内存池，在同一把锁上死锁
+inline static void* SystemAlloc(size_t nPages)
+{
+	size_t bytes = nPages << PAGE_SHIFT;
+
+#ifdef CMP_USE_HUGEPAGE
+	if (bytes >= HUGE_PAGE_SIZE)
+	{
+#ifdef MAP_HUGETLB
+		// 优先使用预留的hugetlbfs大页，长度必须是大页大小的整数倍，映射出来的地址天然按2MB对齐
+		if (bytes % HUGE_PAGE_SIZE == 0)
+		{
+			void* huge = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (huge != MAP_FAILED) return huge;
+		}
+#endif
+
+		// 没有预留大页时裁剪出按2MB对齐的区间，再通过madvise申请透明大页
+		void* aligned = SystemMapAligned(bytes, HUGE_PAGE_SIZE);
+#ifdef MADV_HUGEPAGE
+		if (aligned) madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+		return aligned;
+	}
+#endif
+
+	return SystemMapAligned(bytes, (size_t)1 << PAGE_SHIFT);
+}
+
+// 释放通过mmap申请的空间，munmap需要知道映射的长度
+inline static void SystemFree(void* ptr, size_t nPages)
+{
+	munmap(ptr, nPages << PAGE_SHIFT);
+}
+
+// 把空闲页的物理内存还给操作系统，保留虚拟地址，RSS随之下降
+inline static void SystemRelease(void* ptr, size_t nPages)
+{
+	madvise(ptr, nPages << PAGE_SHIFT, MADV_DONTNEED);
+}
+
+// MADV_DONTNEED之后的页再次访问时由内核缺页补上全零页，不需要显式提交
+inline static void SystemCommit(void*, size_t)
+{}
+
+// 设置页是否可以访问，用于大块内存的保护页
+inline static void SystemProtect(void* ptr, size_t nPages, bool accessible)
+{
+	mprotect(ptr, nPages << PAGE_SHIFT, accessible ? PROT_READ | PROT_WRITE : PROT_NONE);
+}
+#endif
+
+// 把ptr处nPages页的映射扩大到newPages页：target为空时原地扩展，否则整体移动到target（替换target处原有的映射）
+// 内核只移动页表项，不拷贝数据；不支持时返回false，调用方退回到申请新内存并拷贝
+inline static bool SystemRemap(void* ptr, size_t nPages, size_t newPages, void* target)
+{
+#ifdef __linux__
+	void* ret = target == nullptr
+		? mremap(ptr, nPages << PAGE_SHIFT, newPages << PAGE_SHIFT, 0)
+		: mremap(ptr, nPages << PAGE_SHIFT, newPages << PAGE_SHIFT, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+	return ret != MAP_FAILED;
+#else
+	return false;
+#endif
+}
+
+// 单调时钟的毫秒数，用于记录span空闲的时长
+inline static uint64_t NowMs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 最低位的1之后的0的个数，bits不能为0
+inline static size_t CountTrailingZeros(uint64_t bits)
+{
+	assert(bits != 0);
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return index;
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+// 自旋锁，用于临界区只有几条指令的场景（如transfer cache的槽位交换）
+class SpinLock
+{
+public:
+    void lock()
+    {
+        while (_flag.test_and_set(std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    void unlock() { _flag.clear(std::memory_order_release); }
+
+private:
+    std::atomic_flag _flag = ATOMIC_FLAG_INIT;
+};
+
 // 访问小块内存中的头4/8个字节，即下一个内存块的地址
 static void*& NextObj(void* obj) { return *(void**)obj; }
 
+#ifdef CMP_HARDENED
+// 加固模式检测到堆损坏：打印原因和地址后立即abort，不依赖assert，release构建中同样生效
+inline static void HardenedAbort(const char* msg, const void* ptr)
+{
+	char buf[256];
+	int len = snprintf(buf, sizeof(buf), "ConcurrentMemoryPool: %s (%p)\n", msg, ptr);
+#ifdef _WIN32
+	fwrite(buf, 1, len, stderr);
+#else
+	ssize_t ret = write(STDERR_FILENO, buf, len);
+	(void)ret;
+#endif
+	abort();
+}
+
+// 进程级的随机密钥，用于编码自由链表指针和生成canary，第一次使用时生成
+// 不加static，所有编译单元共用同一个密钥
+inline uintptr_t HardenedKey()
+{
+	static const uintptr_t key = [] {
+		uintptr_t k = 0;
+#ifndef _WIN32
+		int fd = open("/dev/urandom", O_RDONLY);
+		if (fd >= 0)
+		{
+			ssize_t ret = read(fd, &k, sizeof(k));
+			(void)ret;
+			close(fd);
+		}
+#endif
+		// 读不到随机数时也混入栈地址和时间，密钥不可预测
+		k ^= (uintptr_t)&k ^ (uintptr_t)(std::chrono::steady_clock::now().time_since_epoch().count() * 0x9E3779B97F4A7C15ULL);
+		return k;
+	}();
+
+	return key;
+}
+
+// 编码/解码自由链表中obj存放的下一个内存块的地址：和obj所在的地址、随机密钥异或，两次异或还原
+// 释放后仍然写入内存块的程序会把链表指针改成随机值，取出时大概率通不过对齐检查
+inline static void* MaskLink(void* obj, void* next)
+{
+	return (void*)((uintptr_t)next ^ ((uintptr_t)obj >> PAGE_SHIFT) ^ HardenedKey());
+}
+#endif
+
 // 管理切割好的内存块的自由链表
 class FreeList
 {
@@ -49,17 +262,26 @@ public:
         assert(obj);
 
         // 头插
-        NextObj(obj) = _freeList;
+        StoreLink(obj, _freeList);
         _freeList = obj;
-        ++_size;
+        Add(_size, 1);
     }
 
-    // 向自由链表中插入多个内存块
+    // 向自由链表中插入多个内存块，[start, end]是用NextObj串起来的链表
     void PushRange(void* start, void* end, size_t n)
     {
-        NextObj(end) = _freeList;
+#ifdef CMP_HARDENED
+        // 传入的链表指针没有编码，逐个编码
+        for (void* cur = start; cur != end; )
+        {
+            void* next = NextObj(cur);
+            StoreLink(cur, next);
+            cur = next;
+        }
+#endif
+        StoreLink(end, _freeList);
         _freeList = start;
-        _size += n;
+        Add(_size, n);
     }
 
     void* Pop()
@@ -68,39 +290,95 @@ public:
 
         // 头删
         void* obj = _freeList;
-        _freeList = NextObj(obj);
-        --_size;
+        _freeList = LoadLink(obj);
+        size_t size = _size.load(std::memory_order_relaxed) - 1;
+        _size.store(size, std::memory_order_relaxed);
+        if (size < _lowWater) _lowWater = size;
 
         return obj;
     }
 
+    // 取出n个内存块，取出的[start, end]用NextObj串起来
     void PopRange(void*& start, void*& end, size_t n)
     {
-        assert(n >= _size);
+        size_t size = _size.load(std::memory_order_relaxed);
+        assert(n <= size);
 
         start = _freeList;
         end = start;
 
-        for (int i = 0; i < n - 1; ++i)
+        for (size_t i = 0; i < n - 1; ++i)
         {
-            end = NextObj(end);
+            void* next = LoadLink(end);
+#ifdef CMP_HARDENED
+            NextObj(end) = next; // 还原成没有编码的指针
+#endif
+            end = next;
         }
 
-        _freeList = NextObj(end);
+        _freeList = LoadLink(end);
         NextObj(end) = nullptr;
-        _size -= n;
+        size -= n;
+        _size.store(size, std::memory_order_relaxed);
+        if (size < _lowWater) _lowWater = size;
     }
 
     bool Empty() { return _freeList == nullptr; }
 
-    size_t Size() { return _size; }
+    size_t Size() { return _size.load(std::memory_order_relaxed); }
 
     size_t& MaxSize() { return _maxSize; }
 
+    size_t FetchCount() { return _fetchCount.load(std::memory_order_relaxed); }
+
+    void AddFetchCount() { Add(_fetchCount, 1); }
+
+    size_t OverflowCount() { return _overflowCount.load(std::memory_order_relaxed); }
+
+    void AddOverflowCount() { Add(_overflowCount, 1); }
+
+    size_t& LowWater() { return _lowWater; }
+
+    size_t& Overages() { return _overages; }
+
+private:
+    // 计数只由所属线程修改，GetStats在其他线程中读取，所以用relaxed的原子变量，读到的是近似值
+    // 只有一个线程写，读改写拆成load和store，不需要带锁的原子指令
+    static void Add(std::atomic<size_t>& counter, size_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // 读写obj中存放的下一个内存块的地址，加固模式下存放的是编码后的值
+    static void StoreLink(void* obj, void* next)
+    {
+#ifdef CMP_HARDENED
+        NextObj(obj) = MaskLink(obj, next);
+#else
+        NextObj(obj) = next;
+#endif
+    }
+
+    static void* LoadLink(void* obj)
+    {
+#ifdef CMP_HARDENED
+        // 内存块至少按8字节对齐，解码出不对齐的地址说明内存块释放后被写过
+        void* next = MaskLink(obj, NextObj(obj));
+        if ((uintptr_t)next & 7) HardenedAbort("自由链表被破坏，内存块释放后仍被写入", obj);
+        return next;
+#else
+        return NextObj(obj);
+#endif
+    }
+
 private:
     void* _freeList = nullptr; // 自由链表的头指针
     size_t _maxSize = 1;       // 结合慢增长来使用
-    size_t _size = 0;          // 记录自由链表中小内存块的个数
+    std::atomic<size_t> _size{ 0 };          // 记录自由链表中小内存块的个数
+    std::atomic<size_t> _fetchCount{ 0 };    // 向central cache批量申请的次数，统计用
+    std::atomic<size_t> _overflowCount{ 0 }; // 链表过长向central cache批量归还的次数，统计用
+    size_t _lowWater = 0;      // 上次回收以来链表长度的最小值，这么多内存块一直没有被用到
+    size_t _overages = 0;      // 连续超过_maxSize的次数，达到上限后缩小_maxSize
 };
 
 class SizeClass
@@ -112,91 +390,72 @@ public:
     // [1024+1, 8*1024]         128byte对齐       freelist[72,128)
     // [8*1024+1, 64*1024]      1024byte对齐      freelist[128,184)
     // [64*1024+1, 256*1024]    8*1024byte对齐    freelist[184,208)
+    // 上面的区间规则只在编译期用来生成查找表，运行时的Index()、RoundUp()、NumMoveSize()都只查表
 
     // RoundUp()的辅助函数
-    static inline size_t _RoundUp(size_t bytes, size_t align)
+    static constexpr size_t _RoundUp(size_t bytes, size_t align)
     {
         return (((bytes)+align - 1) & ~(align - 1));
     }
 
     // 计算按bytes大小申请内存实际申请到的内存大小
-    static inline size_t RoundUp(size_t bytes)
+    static inline size_t RoundUp(size_t bytes);
+
+    // 计算按align对齐申请bytes字节时要向内存池申请的大小（align为2的整数次幂且不超过一页）
+    // span起始地址按页对齐、内存块按对齐后的大小依次切分，把大小向上对齐到align的整数倍后，
+    // 不论落在哪个区间，对齐后的大小都是align的整数倍，span中切出的每个内存块都满足对齐要求
+    static inline size_t AlignedSize(size_t bytes, size_t align)
     {
-        if (bytes <= 128)
-        {
-            return _RoundUp(bytes, 8);
-        }
-        else if (bytes <= 1024)
-        {
-            return _RoundUp(bytes, 16);
-        }
-        else if (bytes <= 8 * 1024)
-        {
-            return _RoundUp(bytes, 128);
-        }
-        else if (bytes <= 64 * 1024)
-        {
-            return _RoundUp(bytes, 1024);
-        }
-        else if (bytes <= 256 * 1024)
-        {
-            return _RoundUp(bytes, 8 * 1024);
-        }
-        else
-        {
-            return _RoundUp(bytes, 1 << PAGE_SHIFT);
-        }
+        assert(align <= ((size_t)1 << PAGE_SHIFT));
 
-        return -1;
+        return align <= 8 ? bytes : _RoundUp(bytes, align);
     }
 
-    // Index()的辅助函数
-    static inline size_t _Index(size_t bytes, size_t align_shift)
+    // 查找表的下标：1KB以内按8字节一格，1KB以上按128字节一格，两段首尾相接
+    // 各区间的对齐粒度都是格子大小的整数倍，同一个格子中的大小一定映射到同一个自由链表桶
+    static constexpr size_t ClassArrayIndex(size_t bytes)
     {
-        return ((bytes + (1 << align_shift) - 1) >> align_shift) - 1;
+        return bytes <= 1024 ? (bytes + 7) >> 3 : (bytes + 127 + (120 << 7)) >> 7;
     }
 
     // 计算映射到哪个自由链表桶
-    static inline size_t Index(size_t bytes)
-    {
-        assert(bytes <= MAX_BYTES);
-
-        static int group_array[4] = { 16, 56, 56, 56 }; // 每个区间有多少个自由链表桶
+    static inline size_t Index(size_t bytes);
 
-        if (bytes <= 128)
+    // Index()的逆运算，计算自由链表桶对应的对齐后的内存块大小
+    static constexpr size_t IndexToSize(size_t index)
+    {
+        if (index < 16)
         {
-            return _Index(bytes, 3);
+            return (index + 1) << 3;
         }
-        else if (bytes <= 1024)
+        else if (index < 72)
         {
-            return _Index(bytes - 128, 4) + group_array[0];
+            return 128 + ((index - 16 + 1) << 4);
         }
-        else if (bytes <= 8 * 1024)
+        else if (index < 128)
         {
-            return _Index(bytes - 1024, 7) + group_array[0] + group_array[1];
+            return 1024 + ((index - 72 + 1) << 7);
         }
-        else if (bytes <= 64 * 1024)
+        else if (index < 184)
         {
-            return _Index(bytes - 8 * 1024, 10) + group_array[0] + group_array[1] + group_array[2];
+            return 8 * 1024 + ((index - 128 + 1) << 10);
         }
-        else if (bytes <= 256 * 1024)
+        else
         {
-            return _Index(bytes - 64 * 1024, 13) + group_array[0] + group_array[1] + group_array[2] + group_array[3];
+            return 64 * 1024 + ((index - 184 + 1) << 13);
         }
-        else assert(false);
-
-        return -1;
     }
 
-    // thread cache一次从central cache中获取多少个内存对象
-    static inline size_t NumMoveSize(size_t size)
-    {
-        assert(size > 0);
+    // thread cache一次从central cache中获取多少个内存对象（查表）
+    static inline size_t NumMoveSize(size_t size);
 
+    // 生成查找表用的NumMoveSize规则
+    static constexpr size_t _NumMoveSize(size_t size)
+    {
         // 一次性批量移动内存对象的取值为：[2, 512]
         // 小内存对象一次性移动的数量上限高
         // 大内存对象一次性移动的数量上限低
-        int num = MAX_BYTES / size;
+        size_t num = MAX_BYTES / size;
         if (num < 2) num = 2;
         if (num > 512) num = 512;
 
@@ -217,6 +476,94 @@ public:
     }
 };
 
+static const size_t CLASS_ARRAY_SIZE = SizeClass::ClassArrayIndex(MAX_BYTES) + 1; // 大小到自由链表桶的查找表长度
+
+// 编译期生成的size class查找表
+struct SizeClassTable
+{
+    uint8_t _classIndex[CLASS_ARRAY_SIZE] = {}; // ClassArrayIndex(size) -> 自由链表桶下标
+    uint32_t _classSize[N_FREELISTS] = {};      // 自由链表桶下标 -> 对齐后的内存块大小
+    uint16_t _classBatch[N_FREELISTS] = {};     // 自由链表桶下标 -> 一次批量移动的内存块个数
+};
+
+static constexpr SizeClassTable BuildSizeClassTable()
+{
+    SizeClassTable table;
+
+    size_t slot = 0;
+    for (size_t index = 0; index < N_FREELISTS; ++index)
+    {
+        size_t size = SizeClass::IndexToSize(index);
+        table._classSize[index] = (uint32_t)size;
+        table._classBatch[index] = (uint16_t)SizeClass::_NumMoveSize(size);
+
+        // 上一个桶的大小之后、直到这个桶的大小为止的格子都映射到这个桶
+        for (; slot <= SizeClass::ClassArrayIndex(size); ++slot)
+        {
+            table._classIndex[slot] = (uint8_t)index;
+        }
+    }
+
+    return table;
+}
+
+static constexpr SizeClassTable SIZE_CLASS_TABLE = BuildSizeClassTable();
+
+static_assert(N_FREELISTS <= 256, "自由链表桶的下标要能放进uint8_t");
+static_assert(SizeClass::IndexToSize(N_FREELISTS - 1) == MAX_BYTES, "最后一个自由链表桶的大小必须是MAX_BYTES");
+
+inline size_t SizeClass::Index(size_t bytes)
+{
+    assert(bytes <= MAX_BYTES);
+
+    return SIZE_CLASS_TABLE._classIndex[ClassArrayIndex(bytes)];
+}
+
+inline size_t SizeClass::RoundUp(size_t bytes)
+{
+    if (bytes <= MAX_BYTES)
+    {
+        return SIZE_CLASS_TABLE._classSize[Index(bytes)];
+    }
+    else
+    {
+        return _RoundUp(bytes, 1 << PAGE_SHIFT);
+    }
+}
+
+inline size_t SizeClass::NumMoveSize(size_t size)
+{
+    assert(size > 0);
+
+    return SIZE_CLASS_TABLE._classBatch[Index(size)];
+}
+
+#if defined(CMP_SPAN_BITMAP) || defined(CMP_HARDENED)
+// 定义CMP_SPAN_BITMAP后，central cache中span的空闲内存块用span内的位图记录，而不是穿过内存块的自由链表
+// 定义CMP_HARDENED后，span用同样大小的位图记录哪些内存块分配给了用户，检测重复释放
+static const size_t MAX_SPAN_OBJECTS = (1 << PAGE_SHIFT) / 8;     // 一个span最多切出的内存块个数（一页切成8字节的块）
+static const size_t SPAN_BITMAP_WORDS = MAX_SPAN_OBJECTS / 64;    // 空闲位图的字数
+
+// 所有size class的span中内存块个数的最大值，span的页数按NumMovePage计算
+// 这里重复了NumMovePage的计算，修改NumMovePage时要同步修改；CentralCache::GetOneSpan在运行时再按实际的页数检查一次
+static constexpr size_t MaxSpanObjects()
+{
+    size_t maxObjs = 0;
+    for (size_t index = 0; index < N_FREELISTS; ++index)
+    {
+        size_t size = SIZE_CLASS_TABLE._classSize[index];
+        size_t nPages = (size * SIZE_CLASS_TABLE._classBatch[index]) >> PAGE_SHIFT;
+        if (nPages == 0) nPages = 1;
+
+        maxObjs = std::max(maxObjs, (nPages << PAGE_SHIFT) / size);
+    }
+
+    return maxObjs;
+}
+
+static_assert(MaxSpanObjects() <= MAX_SPAN_OBJECTS, "span的位图放不下所有内存块");
+#endif
+
 // 管理多个连续页大块内存跨度的结构
 struct Span
 {
@@ -228,6 +575,51 @@ struct Span
     size_t _useCount = 0;	   // 切割的小块内存，分配给thread cache的计数
     void* _freeList = nullptr; // 管理切割的小块内存的自由链表
     bool _isUse = false;       // 标记该span是否被使用
+    bool _isReleased = false;  // span空闲时其物理页是否已经归还给操作系统
+    bool _mapStart = false;    // span的首页是否是一次SystemAlloc映射的首页，合并时不跨过映射的边界
+    uint64_t _freeTime = 0;    // span进入page cache的时间（毫秒），用于判断空闲时长
+    size_t _shard = 0;         // span所属的page cache分片，归还时回到这个分片
+    size_t _node = 0;          // span所属的NUMA节点，小块内存归还到这个节点的central cache
+#ifdef CMP_SPAN_BITMAP
+    size_t _freeCount = 0;                          // 位图中空闲内存块的个数
+    uint64_t _freeBits[SPAN_BITMAP_WORDS] = {};     // 第i位为1表示第i个内存块空闲
+#endif
+#ifdef CMP_HEAP_PROFILER
+    std::atomic<size_t> _sampledObjs{ 0 }; // span中被堆分析采样的内存块数，为0时释放不用查采样记录
+#endif
+#ifdef CMP_REMOTE_FREE
+    std::atomic<void*> _owner{ nullptr };  // 最近从这个span取走内存块的thread cache，其他线程释放的内存块交还给它
+#endif
+#ifdef CMP_HARDENED
+    std::atomic<uint64_t> _allocBits[SPAN_BITMAP_WORDS] = {}; // 第i位为1表示第i个内存块在用户手中，申请和释放的线程都会修改
+    bool _guarded = false;     // 大块内存span的首尾页是否是保护页
+#endif
+};
+
+// 一个size class的统计信息，各层的计数只在获取统计信息时汇总
+struct SizeClassStats
+{
+    size_t _objSize = 0;           // 对齐后的内存块大小
+    size_t _threadCacheObjs = 0;   // 所有thread cache（或每CPU缓存）中缓存的内存块数，含远程释放栈中的
+    size_t _remoteFreeObjs = 0;    // 其中其他线程释放、等着交还给owner线程的内存块数（CMP_REMOTE_FREE）
+    size_t _transferCacheObjs = 0; // transfer cache中缓存的内存块数
+    size_t _centralFreeObjs = 0;   // central cache的span中尚未分配出去的内存块数
+    size_t _centralSpans = 0;      // central cache持有的span数
+    size_t _centralPages = 0;      // central cache持有的span的总页数
+    size_t _centralUsedObjs = 0;   // 从span中分配出去的内存块数（含各级缓存中的）
+    size_t _fetchCount = 0;        // thread cache向central cache批量申请的次数
+    size_t _overflowCount = 0;     // thread cache链表过长批量归还的次数
+};
+
+// 整个内存池的统计信息
+struct AllocatorStats
+{
+    SizeClassStats _classes[N_FREELISTS];
+    size_t _threadCaches = 0;         // 存活的thread cache（含每CPU缓存槽位）个数
+    size_t _systemPages = 0;          // 从操作系统申请且尚未释放的页数
+    size_t _pageCacheSpans = 0;       // page cache中空闲的span数
+    size_t _pageCachePages = 0;       // page cache中空闲的页数
+    size_t _pageCacheReleasedPages = 0; // 空闲页中已经归还给操作系统的页数
 };
 
 // 带头双向循环链表
@@ -236,7 +628,8 @@ class SpanList
 public:
     SpanList()
     {
-        _head = new Span();
+        // 头结点直接内嵌在SpanList中，不通过new申请，替换了全局operator new时不会在构造单例的过程中重入内存池
+        _head = &_headSpan;
         _head->_prev = _head;
         _head->_next = _head;
     }
@@ -286,6 +679,127 @@ public:
     std::mutex& GetMutex() { return _mtx; }
 
 private:
+    Span _headSpan;  // 头结点对象
     Span* _head;     // 头结点
     std::mutex _mtx; // 桶锁，属于当前这个自由链表桶的锁
+};
+
+// 按页数有序的span树（treap），管理page cache中超过128页的空闲span，用于最佳适配查找
+// 以(页数, 页号)为键，优先级由页号散列得到；左右孩子复用span的_prev/_next，不需要额外申请内存
+class SpanTree
+{
+public:
+    bool Empty() { return _root == nullptr; }
+
+    void Insert(Span* span)
+    {
+        span->_prev = span->_next = nullptr;
+
+        Span* left = nullptr;
+        Span* right = nullptr;
+        Split(_root, span->_nPages, span->_pageId, left, right);
+        _root = Merge(Merge(left, span), right);
+    }
+
+    void Erase(Span* span)
+    {
+        Span* left = nullptr;
+        Span* mid = nullptr;
+        Span* right = nullptr;
+        Split(_root, span->_nPages, span->_pageId, left, mid);
+        Split(mid, span->_nPages, span->_pageId + 1, mid, right);
+        assert(mid == span);
+        _root = Merge(left, right);
+
+        span->_prev = span->_next = nullptr;
+    }
+
+    // 不少于nPages页的span中最小的一个，没有时返回nullptr
+    Span* LowerBound(size_t nPages)
+    {
+        Span* best = nullptr;
+        Span* cur = _root;
+        while (cur)
+        {
+            if (cur->_nPages >= nPages)
+            {
+                best = cur;
+                cur = cur->_prev;
+            }
+            else
+            {
+                cur = cur->_next;
+            }
+        }
+
+        return best;
+    }
+
+    // 按页数从小到大遍历，func中不能修改树
+    template<class Func>
+    void ForEach(Func func)
+    {
+        ForEach(_root, func);
+    }
+
+private:
+    static bool Less(Span* span, size_t nPages, PAGE_ID pageId)
+    {
+        return span->_nPages < nPages || (span->_nPages == nPages && span->_pageId < pageId);
+    }
+
+    static size_t Priority(Span* span)
+    {
+        return (size_t)(span->_pageId * 0x9E3779B97F4A7C15ULL);
+    }
+
+    // 把t分成键小于(nPages, pageId)的left和其余的right
+    static void Split(Span* t, size_t nPages, PAGE_ID pageId, Span*& left, Span*& right)
+    {
+        if (t == nullptr)
+        {
+            left = right = nullptr;
+        }
+        else if (Less(t, nPages, pageId))
+        {
+            Split(t->_next, nPages, pageId, t->_next, right);
+            left = t;
+        }
+        else
+        {
+            Split(t->_prev, nPages, pageId, left, t->_prev);
+            right = t;
+        }
+    }
+
+    // 合并两棵树，left中的键都小于right中的键
+    static Span* Merge(Span* left, Span* right)
+    {
+        if (left == nullptr) return right;
+        if (right == nullptr) return left;
+
+        if (Priority(left) > Priority(right))
+        {
+            left->_next = Merge(left->_next, right);
+            return left;
+        }
+        else
+        {
+            right->_prev = Merge(left, right->_prev);
+            return right;
+        }
+    }
+
+    template<class Func>
+    static void ForEach(Span* t, Func& func)
+    {
+        if (t == nullptr) return;
+
+        ForEach(t->_prev, func);
+        func(t);
+        ForEach(t->_next, func);
+    }
+
+private:
+    Span* _root = nullptr;
 };
\ No newline at end of file
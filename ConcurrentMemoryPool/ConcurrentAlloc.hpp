@@ -2,56 +2,586 @@
 
 #include "Common.hpp"
 #include "ThreadCache.hpp"
+#include "CpuCache.hpp"
 #include "PageCache.hpp"
 #include "ObjectPool.hpp"
+#include "AllocatorStats.hpp"
+#include "HeapProfiler.hpp"
+#include "Hardened.hpp"
+#include <condition_variable>
 
-static void* ConcurrentAlloc(size_t size)
+// 批量申请失败时用来释放已经申请到的内存
+static inline void ConcurrentFreeBatch(void** ptrs, size_t n);
+
+// 申请size字节的内存，size超过MAX_ALLOC_BYTES或者内存不足时返回nullptr，不抛异常
+// 内存池持有锁时不能抛异常（替换了malloc后申请异常对象会重入内存池），失败一路以nullptr返回到这里，
+// 所有锁都已经释放，再由调用方决定是设置errno还是抛出bad_alloc
+static inline void* ConcurrentAllocNothrow(size_t size)
 {
+	if (size > MAX_ALLOC_BYTES) return nullptr;
+
+	size = HardenedSize(size); // 加固模式下多申请放canary的空间
+
 	if (size > MAX_BYTES)
 	{
 		size_t alignSize = SizeClass::RoundUp(size);
 		size_t nPages = alignSize >> PAGE_SHIFT;
 
-		PageCache::GetInstance()->GetMutex().lock();
-		Span* span = PageCache::GetInstance()->GetSpan(nPages);
+		// 开启保护页时前后各多申请GUARD_PAGES页
+		Span* span = PageCache::GetInstance()->GetSpan(nPages + 2 * GUARD_PAGES);
+		if (span == nullptr) return nullptr;
+
 		span->_objSize = size; // 设置span下挂的小内存块的大小
-		PageCache::GetInstance()->GetMutex().unlock();
 
-		void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
+		void* ptr = GuardLargeSpan(span);
 
-		return ptr;
+		return SampleAllocation(ptr, size);
 	}
 	else
 	{
+#ifdef CMP_PER_CPU_CACHE
+		// 每CPU缓存模式下从当前CPU的缓存中分配
+		if (CpuCache::GetInstance()->Enabled())
+		{
+			void* ptr = CpuCache::GetInstance()->Allocate(size);
+			if (ptr == nullptr) return nullptr;
+
+			return SampleAllocation(HardenAllocation(ptr), size);
+		}
+#endif
+
 		// 通过TLS，每个线程可以无锁的获取属于自己的专属的ThreadCache对象
 		if (pTLSThreadCache == nullptr)
 		{
-			// 线程局部存储为空，则创建一个ThreadCache对象的定长内存池
-			static ObjectPool<ThreadCache> threadCachePool;
-			pTLSThreadCache = threadCachePool.New();
+			// 线程局部存储为空，则从ThreadCache对象的定长内存池中创建一个
+			if (CreateThreadCache() == nullptr) return nullptr;
 		}
 
 		//std::cout << std::this_thread::get_id() << ":" << pTLSThreadCache << std::endl;
 
-		return pTLSThreadCache->Allocate(size);
+		void* ptr = pTLSThreadCache->Allocate(size);
+		if (ptr == nullptr) return nullptr;
+
+		return SampleAllocation(HardenAllocation(ptr), size);
 	}
 }
 
-static void ConcurrentFree(void* ptr)
+// 申请size字节的内存，失败时抛出std::bad_alloc
+static inline void* ConcurrentAlloc(size_t size)
+{
+	void* ptr = ConcurrentAllocNothrow(size);
+	if (ptr == nullptr) throw std::bad_alloc();
+
+	return ptr;
+}
+
+// 一次申请n个size字节的内存，写入out[0, n)
+// 小块内存整段从thread cache的自由链表中取出，不够时直接向central cache批量申请，size class的计算和各种判断对整批只做一次
+// 失败时已经申请到的内存全部释放，抛出std::bad_alloc
+static inline void ConcurrentAllocBatch(size_t size, size_t n, void** out)
 {
-	Span* span = PageCache::GetInstance()->MapObjToSpan(ptr);
+	if (size > MAX_ALLOC_BYTES) throw std::bad_alloc();
+
+	size_t hardenedSize = HardenedSize(size);
+
+	// 大块内存、每CPU缓存模式下逐个申请
+	bool oneByOne = hardenedSize > MAX_BYTES;
+#ifdef CMP_PER_CPU_CACHE
+	oneByOne = oneByOne || CpuCache::GetInstance()->Enabled();
+#endif
+	if (oneByOne)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			out[i] = ConcurrentAllocNothrow(size);
+			if (out[i] == nullptr)
+			{
+				ConcurrentFreeBatch(out, i);
+				throw std::bad_alloc();
+			}
+		}
+		return;
+	}
+
+	if (pTLSThreadCache == nullptr && CreateThreadCache() == nullptr) throw std::bad_alloc();
+
+	if (!pTLSThreadCache->AllocateBatch(hardenedSize, n, out)) throw std::bad_alloc();
+
+	// 不开启加固和堆分析时是空循环，会被编译器去掉
+	for (size_t i = 0; i < n; ++i)
+	{
+		out[i] = SampleAllocation(HardenAllocation(out[i]), hardenedSize);
+	}
+}
+
+// 申请size字节、起始地址按align对齐的内存，align必须是2的整数次幂
+// 不超过一页的对齐通过选择步长是align整数倍的size class实现；超过一页的对齐从page cache切出起始页对齐的span，
+// 这种内存不论大小都按大块内存管理
+// size或align超过MAX_ALLOC_BYTES、内存不足时返回nullptr，不抛异常
+static inline void* ConcurrentAllocAlignedNothrow(size_t size, size_t align)
+{
+	assert(align != 0 && (align & (align - 1)) == 0);
+
+	if (size > MAX_ALLOC_BYTES || align > MAX_ALLOC_BYTES) return nullptr;
+
+	if (align <= ((size_t)1 << PAGE_SHIFT))
+	{
+		// ConcurrentAllocNothrow会再加上canary的大小，先减掉，保证对齐后的大小仍是align的整数倍
+		return ConcurrentAllocNothrow(SizeClass::AlignedSize(HardenedSize(size), align) - CANARY_SIZE);
+	}
+
+	size_t nPages = SizeClass::_RoundUp(size, (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT;
+
+	Span* span = PageCache::GetInstance()->GetAlignedSpan(nPages, align >> PAGE_SHIFT);
+	if (span == nullptr) return nullptr;
+
+	span->_objSize = std::max(size, MAX_BYTES + 1); // _objSize大于MAX_BYTES，释放时按大块内存归还span
+
+	return SampleAllocation((void*)(span->_pageId << PAGE_SHIFT), size);
+}
+
+// 申请size字节、起始地址按align对齐的内存，失败时抛出std::bad_alloc
+static inline void* ConcurrentAllocAligned(size_t size, size_t align)
+{
+	void* ptr = ConcurrentAllocAlignedNothrow(size, align);
+	if (ptr == nullptr) throw std::bad_alloc();
+
+	return ptr;
+}
+
+// 将对齐后大小为alignSize的小块内存归还给当前线程（或当前CPU）的缓存
+static inline void ConcurrentFreeSmall(void* ptr, size_t alignSize)
+{
+#ifdef CMP_PER_CPU_CACHE
+	if (CpuCache::GetInstance()->Enabled())
+	{
+		CpuCache::GetInstance()->Deallocate(ptr, alignSize);
+		return;
+	}
+#endif
+
+	if (pTLSThreadCache == nullptr)
+	{
+		// 当前线程没有ThreadCache（没有申请过内存，或者正在退出），直接归还给central cache
+		NextObj(ptr) = nullptr;
+		CentralCache::GetInstance()->ReleaseListToSpans(ptr, alignSize);
+		return;
+	}
+
+#ifdef CMP_REMOTE_FREE
+	// 内存块所在的span最近被其他thread cache取过内存块，交还给那个thread cache
+	ThreadCache* owner = (ThreadCache*)PageCache::GetInstance()->MapObjToSpan(ptr)->_owner.load(std::memory_order_acquire);
+	if (owner != nullptr && owner != pTLSThreadCache)
+	{
+		pTLSThreadCache->DeallocateRemote(ptr, alignSize, owner);
+		return;
+	}
+#endif
+
+	pTLSThreadCache->Deallocate(ptr, alignSize);
+}
+
+static inline void ConcurrentFree(void* ptr)
+{
+	Span* span = LookupSpan(ptr);
 	size_t size = span->_objSize;
+	RecordFree(ptr, span);
 
 	if (size > MAX_BYTES)
 	{
-		PageCache::GetInstance()->GetMutex().lock();
+		UnguardLargeSpan(span);
 		PageCache::GetInstance()->ReleaseSpanToPageCache(span);
-		PageCache::GetInstance()->GetMutex().unlock();
 	}
 	else
 	{
-		assert(pTLSThreadCache);
+		HardenFree(ptr, span);
+		ConcurrentFreeSmall(ptr, size);
+	}
+}
+
+// 将[start, end]这n个对齐后大小为alignSize的小块内存整段归还给当前线程的thread cache
+static inline void ConcurrentFreeSmallRange(void* start, void* end, size_t n, size_t alignSize)
+{
+	bool oneByOne = pTLSThreadCache == nullptr;
+#ifdef CMP_PER_CPU_CACHE
+	oneByOne = oneByOne || CpuCache::GetInstance()->Enabled();
+#endif
+#ifdef CMP_REMOTE_FREE
+	oneByOne = true; // 每个内存块要按所在span的owner分别处理
+#endif
+	if (oneByOne)
+	{
+		while (start)
+		{
+			void* next = NextObj(start);
+			ConcurrentFreeSmall(start, alignSize);
+			start = next;
+		}
+		return;
+	}
+
+	pTLSThreadCache->DeallocateRange(start, end, n, alignSize);
+}
+
+// 释放ptrs[0, n)中的内存，大小可以不同
+// 相邻的同一size class的小块内存串成一段整体放入thread cache的自由链表，链表过长、缓存超限的判断对整段只做一次
+static inline void ConcurrentFreeBatch(void** ptrs, size_t n)
+{
+	size_t i = 0;
+	while (i < n)
+	{
+		Span* span = LookupSpan(ptrs[i]);
+		size_t size = span->_objSize;
+
+		if (size > MAX_BYTES)
+		{
+			ConcurrentFree(ptrs[i++]);
+			continue;
+		}
+
+		void* start = ptrs[i];
+		void* end = start;
+		size_t count = 0;
+		while (true)
+		{
+			RecordFree(ptrs[i], span);
+			HardenFree(ptrs[i], span);
+			if (count > 0)
+			{
+				NextObj(end) = ptrs[i];
+				end = ptrs[i];
+			}
+			++count;
+
+			if (++i == n) break;
+			span = LookupSpan(ptrs[i]);
+			if (span->_objSize != size) break;
+		}
+		NextObj(end) = nullptr;
+
+		ConcurrentFreeSmallRange(start, end, count, size);
+	}
+}
+
+// 调用方知道申请时的大小，小块内存直接按大小计算自由链表桶，不需要通过基数树查找span
+// size必须和ConcurrentAlloc时传入的大小相同（或映射到同一个size class）
+static inline void ConcurrentFree(void* ptr, size_t size)
+{
+#ifdef CMP_HARDENED
+	// 加固模式下总是通过span做完整的校验，同时检查size和申请时的大小是否一致
+	Span* span = LookupSpan(ptr);
+	size = HardenedSize(size);
+	if (span->_objSize <= MAX_BYTES && (size > MAX_BYTES || SizeClass::RoundUp(size) != span->_objSize))
+	{
+		HardenedAbort("释放时传入的大小和申请时不一致", ptr);
+	}
+
+	ConcurrentFree(ptr);
+	return;
+#endif
+
+	if (size > MAX_BYTES)
+	{
+		ConcurrentFree(ptr); // 大块内存要归还span，仍然需要查找span
+	}
+	else
+	{
+#ifdef CMP_HEAP_PROFILER
+		// 开启堆分析时需要通过span判断这个内存块是否被采样过
+		RecordFree(ptr, PageCache::GetInstance()->MapObjToSpan(ptr));
+#endif
+		ConcurrentFreeSmall(ptr, SizeClass::RoundUp(size));
+	}
+}
 
-		pTLSThreadCache->Deallocate(ptr, size);
+// 释放ConcurrentAllocAligned申请的内存，size和align必须和申请时相同
+static inline void ConcurrentFreeAligned(void* ptr, size_t size, size_t align)
+{
+	if (align <= ((size_t)1 << PAGE_SHIFT))
+	{
+		ConcurrentFree(ptr, SizeClass::AlignedSize(HardenedSize(size), align) - CANARY_SIZE);
+	}
+	else
+	{
+		ConcurrentFree(ptr);
 	}
-}
\ No newline at end of file
+}
+
+// 返回ptr实际可用的字节数：小块内存为对齐后的大小，大块内存为整个span的大小
+static inline size_t ConcurrentUsableSize(void* ptr)
+{
+	Span* span = LookupSpan(ptr);
+	if (span->_objSize > MAX_BYTES) return LargeObjPages(span) << PAGE_SHIFT;
+
+	return span->_objSize - CANARY_SIZE; // 加固模式下末尾的canary不可用
+}
+
+// 把ptr指向的内存调整为newSize字节，内容保留新旧大小中较小的部分
+// 对齐后的大小不变时直接返回ptr；大块内存优先原地扩展span，只有扩展失败时才申请新内存并拷贝
+// newSize超过MAX_ALLOC_BYTES、内存不足时返回nullptr，原来的内存保持不变
+static inline void* ConcurrentReallocNothrow(void* ptr, size_t newSize)
+{
+	if (ptr == nullptr) return ConcurrentAllocNothrow(newSize);
+	if (newSize > MAX_ALLOC_BYTES) return nullptr;
+
+	Span* span = LookupSpan(ptr);
+	size_t oldSize = span->_objSize;
+	size_t hardenedSize = HardenedSize(newSize);
+
+	if (oldSize <= MAX_BYTES)
+	{
+		// 小块内存：size class不变时原样返回
+		if (hardenedSize <= MAX_BYTES && SizeClass::RoundUp(hardenedSize) == oldSize) return ptr;
+	}
+	else if (hardenedSize > MAX_BYTES && !IsGuarded(span))
+	{
+		size_t nPages = SizeClass::RoundUp(hardenedSize) >> PAGE_SHIFT;
+
+		// 缩小到不少于一半时保留原来的span，避免反复扩缩时来回拷贝
+		// 扩大时原地扩展span，mremap移动了映射时起始地址会改变；带保护页的span不原地扩缩
+		// 正在使用的span的页数只有持有它的调用方会修改，这里读取不需要加锁
+		if ((nPages <= span->_nPages && nPages * 2 >= span->_nPages)
+			|| (nPages > span->_nPages && PageCache::GetInstance()->GrowSpan(span, nPages)))
+		{
+			RecordFree(ptr, span);
+			span->_objSize = hardenedSize;
+			return SampleAllocation((void*)(span->_pageId << PAGE_SHIFT), newSize);
+		}
+	}
+
+	void* newPtr = ConcurrentAllocNothrow(newSize);
+	if (newPtr == nullptr) return nullptr;
+
+	memcpy(newPtr, ptr, std::min(ConcurrentUsableSize(ptr), newSize));
+	ConcurrentFree(ptr);
+
+	return newPtr;
+}
+
+// 把ptr指向的内存调整为newSize字节，失败时抛出std::bad_alloc，原来的内存保持不变
+static inline void* ConcurrentRealloc(void* ptr, size_t newSize)
+{
+	void* newPtr = ConcurrentReallocNothrow(ptr, newSize);
+	if (newPtr == nullptr) throw std::bad_alloc();
+
+	return newPtr;
+}
+
+// 把page cache中所有空闲span的物理页立即归还给操作系统，返回归还的字节数
+// 先清空各节点的transfer cache，其中的内存块归还给span后，空出来的span也能归还
+static inline size_t ConcurrentReleaseFreeMemory()
+{
+#ifdef CMP_REMOTE_FREE
+	// 当前线程攒的批先交出去，再把各个thread cache远程释放栈中的内存块收回central cache
+	if (pTLSThreadCache != nullptr) pTLSThreadCache->FlushRemoteBatches();
+	ThreadCache::ReleaseRemoteFrees();
+#endif
+
+	for (size_t i = 0; i < NumaTopology::GetInstance()->NumNodes(); ++i)
+	{
+		CentralCache::GetInstance(i)->Drain();
+	}
+
+	return PageCache::GetInstance()->ReleaseIdleSpans(0) << PAGE_SHIFT;
+}
+
+// 后台回收线程的状态
+struct PageScavenger
+{
+	std::mutex _mtx;
+	std::condition_variable _cond;
+	std::thread _thread;
+	uint64_t _intervalMs = 0; // 回收间隔，线程运行中再次调用StartPageScavenger时更新
+	bool _stop = false;
+};
+
+// 不加static：inline函数中的静态变量在所有编译单元中只有一份，整个程序只有一个回收线程
+inline PageScavenger* GetPageScavenger()
+{
+	// 同PageCache，第一次使用时构造，永不析构：程序退出时线程可能仍在运行，std::thread析构会terminate
+	alignas(PageScavenger) static char storage[sizeof(PageScavenger)];
+	static PageScavenger* scavenger = new(storage)PageScavenger;
+	return scavenger;
+}
+
+// 启动后台回收线程，每隔intervalMs把空闲超过intervalMs的span的物理页归还给操作系统
+// 流量高峰过后即使不再有释放操作，RSS也会回落；重复调用只会启动一个线程，并更新回收间隔，间隔为0时暂停回收
+static inline void StartPageScavenger(uint64_t intervalMs)
+{
+	PageScavenger* scavenger = GetPageScavenger();
+
+	PageCache::GetInstance()->SetReleaseInterval(intervalMs);
+
+	std::lock_guard<std::mutex> lock(scavenger->_mtx);
+	scavenger->_intervalMs = intervalMs;
+	if (scavenger->_thread.joinable())
+	{
+		scavenger->_cond.notify_all(); // 按新的间隔重新等待
+		return;
+	}
+	if (intervalMs == 0) return;
+
+	scavenger->_stop = false;
+	scavenger->_thread = std::thread([scavenger]() {
+		std::unique_lock<std::mutex> lock(scavenger->_mtx);
+		while (!scavenger->_stop)
+		{
+			uint64_t intervalMs = scavenger->_intervalMs;
+			if (intervalMs == 0)
+			{
+				scavenger->_cond.wait(lock);
+				continue;
+			}
+
+			// 被唤醒说明要停止或者间隔改变了，重新检查
+			if (scavenger->_cond.wait_for(lock, std::chrono::milliseconds(intervalMs)) == std::cv_status::no_timeout) continue;
+
+			// 回收时不持有_mtx，StopPageScavenger不用等待回收完成就能发出停止通知
+			lock.unlock();
+			PageCache::GetInstance()->ReleaseIdleSpans(intervalMs);
+			lock.lock();
+		}
+	});
+}
+
+// 停止后台回收线程并等待它退出，之后可以再次调用StartPageScavenger启动
+// 摊还式回收的间隔保持不变，需要时通过StartPageScavenger(0)一并关闭
+static inline void StopPageScavenger()
+{
+	PageScavenger* scavenger = GetPageScavenger();
+
+	std::thread thread;
+	{
+		std::lock_guard<std::mutex> lock(scavenger->_mtx);
+		scavenger->_stop = true;
+		thread = std::move(scavenger->_thread);
+	}
+	scavenger->_cond.notify_all();
+
+	if (thread.joinable()) thread.join();
+}
+
+#ifndef _WIN32
+// fork时其他线程可能正持有内存池的锁，子进程中只剩调用fork的线程，这些锁永远不会被释放
+// 通过pthread_atfork注册下面三个函数：fork前按正常运行时的嵌套顺序加上所有的锁，fork后父子进程各自解锁
+static inline void ConcurrentForkPrepare()
+{
+	// 先构造好所有单例，加锁之后不能再进入可能申请内存的构造过程
+#ifdef CMP_HEAP_PROFILER
+	HeapProfiler* profiler = HeapProfiler::GetInstance();
+#endif
+	CpuCache* cpuCache = CpuCache::GetInstance();
+	ConcurrentObjectPool<ThreadCache>* threadCachePool = ThreadCachePool();
+	PageCache* pageCache = PageCache::GetInstance();
+	ConcurrentObjectPool<Span>* spanPool = SpanPool();
+	size_t nNodes = NumaTopology::GetInstance()->NumNodes();
+	CentralCache::GetInstance();
+
+#ifdef CMP_HEAP_PROFILER
+	profiler->Lock();
+#endif
+	cpuCache->LockAll();          // 持有槽位锁时会进入thread cache、central cache和page cache
+	ThreadCache::LockAll();
+	threadCachePool->LockAll();
+	for (size_t i = 0; i < nNodes; ++i)
+	{
+		CentralCache::GetInstance(i)->LockAll();
+	}
+	pageCache->LockAll();
+	spanPool->LockAll();          // 持有分片锁时会归还span对象
+}
+
+// 按加锁的相反顺序解锁
+static inline void ConcurrentForkParent()
+{
+	SpanPool()->UnlockAll();
+	PageCache::GetInstance()->UnlockAll();
+	for (size_t i = NumaTopology::GetInstance()->NumNodes(); i-- > 0;)
+	{
+		CentralCache::GetInstance(i)->UnlockAll();
+	}
+	ThreadCachePool()->UnlockAll();
+	ThreadCache::UnlockAll();
+	CpuCache::GetInstance()->UnlockAll();
+#ifdef CMP_HEAP_PROFILER
+	HeapProfiler::GetInstance()->Unlock();
+#endif
+}
+
+// 子进程中的锁都由调用fork的线程持有，同样直接解锁
+static inline void ConcurrentForkChild()
+{
+	ConcurrentForkParent();
+}
+#endif
+
+// 设置所有thread cache（含每CPU缓存槽位）合计缓存的字节数上限，默认32MB
+// 忙的线程会从闲的线程挪用容量，总量不超过这个预算（每个thread cache至少保留512KB的下限容量）
+static inline void SetThreadCacheBudget(size_t bytes)
+{
+	ThreadCache::SetOverallBudget(bytes);
+}
+
+static inline size_t GetThreadCacheBudget()
+{
+	return ThreadCache::GetOverallBudget();
+}
+
+// 定义CMP_OVERRIDE_NEW_DELETE后，全局的operator new/delete改为使用内存池
+// 只能在程序中的一个编译单元里定义，C++14的sized delete直接走ConcurrentFree(ptr, size)
+#ifdef CMP_OVERRIDE_NEW_DELETE
+void* operator new(size_t size)
+{
+	return ConcurrentAlloc(size == 0 ? 1 : size);
+}
+
+void* operator new[](size_t size)
+{
+	return ConcurrentAlloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	if (ptr) ConcurrentFree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	if (ptr) ConcurrentFree(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept
+{
+	if (ptr) ConcurrentFree(ptr, size == 0 ? 1 : size);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept
+{
+	if (ptr) ConcurrentFree(ptr, size == 0 ? 1 : size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return ConcurrentAllocNothrow(size == 0 ? 1 : size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	if (ptr) ConcurrentFree(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	if (ptr) ConcurrentFree(ptr);
+}
+
+#ifndef _WIN32
+// 替换了全局的operator new/delete的程序同样需要在fork前后处理内存池的锁，在这个编译单元中注册一次
+static const int cmpForkHandlers = pthread_atfork(ConcurrentForkPrepare, ConcurrentForkParent, ConcurrentForkChild);
+#endif
+#endif
\ No newline at end of file
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "ConcurrentAlloc.hpp"
+
+#include <new>
+#include <limits>
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+#include <memory_resource>
+#define CMP_HAS_MEMORY_RESOURCE 1
+#endif
+
+// 容器按元素个数申请、释放内存，释放时总是带着申请时的大小，可以直接走ConcurrentFree(ptr, size)，
+// 不需要通过基数树查找span。对齐要求不超过8字节时ConcurrentAllocAligned/ConcurrentFreeAligned
+// 等同于ConcurrentAlloc/ConcurrentFree(ptr, size)，超过8字节（如alignas(64)的类型）时按对齐选择size class
+
+// 申请bytes字节时实际向内存池申请的大小，0字节也要返回一个可以释放的有效指针
+static inline size_t AllocatorBytes(size_t bytes)
+{
+	return bytes == 0 ? 1 : bytes;
+}
+
+// STL容器的分配器，没有状态，所有实例之间可以互相释放对方申请的内存
+template<class T>
+class ConcurrentAllocator
+{
+public:
+	typedef T value_type;
+
+	ConcurrentAllocator() noexcept
+	{}
+
+	template<class U>
+	ConcurrentAllocator(const ConcurrentAllocator<U>&) noexcept
+	{}
+
+	T* allocate(size_t n)
+	{
+		if (n > std::numeric_limits<size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+
+		return (T*)ConcurrentAllocAligned(AllocatorBytes(n * sizeof(T)), alignof(T));
+	}
+
+	void deallocate(T* ptr, size_t n) noexcept
+	{
+		ConcurrentFreeAligned(ptr, AllocatorBytes(n * sizeof(T)), alignof(T));
+	}
+};
+
+template<class T, class U>
+bool operator==(const ConcurrentAllocator<T>&, const ConcurrentAllocator<U>&) noexcept
+{
+	return true;
+}
+
+template<class T, class U>
+bool operator!=(const ConcurrentAllocator<T>&, const ConcurrentAllocator<U>&) noexcept
+{
+	return false;
+}
+
+#ifdef CMP_HAS_MEMORY_RESOURCE
+// std::pmr容器使用的内存资源，polymorphic_allocator释放时会传回申请时的大小和对齐
+// 内存池是全局的，所有ConcurrentMemoryResource对象等价，一般直接使用GetInstance()
+class ConcurrentMemoryResource : public std::pmr::memory_resource
+{
+public:
+	// 进程退出时不析构，避免静态对象析构时还有pmr容器在使用它
+	static ConcurrentMemoryResource* GetInstance()
+	{
+		static ConcurrentMemoryResource* resource = new ConcurrentMemoryResource;
+		return resource;
+	}
+
+protected:
+	void* do_allocate(size_t bytes, size_t align) override
+	{
+		return ConcurrentAllocAligned(AllocatorBytes(bytes), align);
+	}
+
+	void do_deallocate(void* ptr, size_t bytes, size_t align) override
+	{
+		ConcurrentFreeAligned(ptr, AllocatorBytes(bytes), align);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return dynamic_cast<const ConcurrentMemoryResource*>(&other) != nullptr;
+	}
+};
+#endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "Common.hpp"
+#include "ThreadCache.hpp"
+
+// 定义CMP_PER_CPU_CACHE后，小块内存从每个CPU一个的缓存中分配，而不是每个线程一个的ThreadCache
+// 缓存的内存量只和CPU核数相关，线程再多也不会无限增长
+// 当前CPU号通过glibc注册的rseq区域读取（内核在线程切换CPU时更新，不需要系统调用），
+// 没有rseq时（非Linux、glibc < 2.35或被tunable关闭）退回到每个线程一个的ThreadCache
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <sched.h>
+#define CMP_HAVE_RSEQ 1
+#endif
+#endif
+
+// 一个CPU的缓存槽位，按缓存行对齐，避免相邻CPU的槽位伪共享
+// 线程可能在持有槽位时被抢占或迁移到其他CPU，所以每个槽位用一把自旋锁保护，正常情况下不会有竞争
+struct alignas(64) CpuCacheSlot
+{
+	SpinLock _lock;
+	ThreadCache _cache;
+};
+
+// 单例模式--懒汉模式
+class CpuCache
+{
+public:
+	static CpuCache* GetInstance()
+	{
+		// 同PageCache，第一次使用时构造，永不析构
+		alignas(CpuCache) static char storage[sizeof(CpuCache)];
+		static CpuCache* instance = new(storage)CpuCache;
+		return instance;
+	}
+
+	// 是否启用了每CPU缓存，未启用时调用方使用线程局部的ThreadCache
+	bool Enabled() { return _slots != nullptr; }
+
+	void* Allocate(size_t size)
+	{
+		CpuCacheSlot& slot = _slots[CurrentCpu()];
+
+		std::lock_guard<SpinLock> lock(slot._lock);
+		return slot._cache.Allocate(size);
+	}
+
+	void Deallocate(void* ptr, size_t size)
+	{
+		CpuCacheSlot& slot = _slots[CurrentCpu()];
+
+		std::lock_guard<SpinLock> lock(slot._lock);
+		slot._cache.Deallocate(ptr, size);
+	}
+
+	// fork前加上所有槽位的锁，fork后在父子进程中解锁
+	void LockAll()
+	{
+		for (size_t i = 0; _slots != nullptr && i < _nCpus; ++i)
+		{
+			_slots[i]._lock.lock();
+		}
+	}
+
+	void UnlockAll()
+	{
+		for (size_t i = 0; _slots != nullptr && i < _nCpus; ++i)
+		{
+			_slots[i]._lock.unlock();
+		}
+	}
+
+private:
+	// 读取当前线程所在的CPU号
+	size_t CurrentCpu()
+	{
+#ifdef CMP_HAVE_RSEQ
+		struct rseq* area = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+		int cpu = (int)__atomic_load_n(&area->cpu_id, __ATOMIC_RELAXED);
+		if (cpu >= 0) return (size_t)cpu % _nCpus;
+#endif
+		return 0;
+	}
+
+private:
+	CpuCacheSlot* _slots = nullptr; // 每个CPU一个槽位，未启用时为空
+	size_t _nCpus = 0;              // 槽位个数
+
+private:
+	CpuCache()
+	{
+#if defined(CMP_PER_CPU_CACHE) && defined(CMP_HAVE_RSEQ)
+		if (__rseq_size == 0) return; // glibc没有为线程注册rseq，退回到线程局部的ThreadCache
+
+		// 槽位数取当前可运行CPU的最大编号+1；不用sysconf，它读取/sys时会申请内存，重入还在构造中的单例
+		cpu_set_t mask;
+		CPU_ZERO(&mask);
+		_nCpus = 1;
+		if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+		{
+			for (size_t i = 0; i < CPU_SETSIZE; ++i)
+			{
+				if (CPU_ISSET(i, &mask)) _nCpus = i + 1;
+			}
+		}
+
+		size_t bytes = SizeClass::_RoundUp(sizeof(CpuCacheSlot) * _nCpus, 1 << PAGE_SHIFT);
+		CpuCacheSlot* slots = (CpuCacheSlot*)SystemAlloc(bytes >> PAGE_SHIFT);
+		if (slots == nullptr) return; // 申请不到槽位时同样退回到线程局部的ThreadCache
+
+		for (size_t i = 0; i < _nCpus; ++i)
+		{
+			new(&slots[i])CpuCacheSlot;
+			slots[i]._cache.SetNode(NumaTopology::GetInstance()->NodeOfCpu(i));
+		}
+		_slots = slots;
+#endif
+	}
+
+	CpuCache(const CpuCache&) = delete;
+};
\ No newline at end of file
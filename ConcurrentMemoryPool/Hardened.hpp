@@ -0,0 +1,157 @@
+#pragma once
+
+#include "Common.hpp"
+#include "PageCache.hpp"
+
+// 定义CMP_HARDENED后开启加固模式，灰度上线时让堆损坏在发生的地方立即暴露，而不是悄悄扩散：
+// 1. thread cache自由链表中的指针编码存放（见FreeList），内存块释放后被写入时，取出时大概率能发现
+// 2. 每个span用位图记录哪些内存块在用户手中，重复释放、释放没有分配出去的内存块时报错
+// 3. 小块内存的末尾放一个和地址相关的canary，释放时检查，发现写越界
+// 4. 释放不是内存池分配的指针、不是内存块起始地址的指针时报错（release构建中MapObjToSpan的assert不生效）
+// 再定义CMP_HARDENED_GUARD_PAGES后，大块内存的前后各加一页不可访问的保护页，越界访问立即触发段错误
+// 检测到错误时打印原因和地址后abort；不定义CMP_HARDENED时下面的函数都是空操作
+
+#ifdef CMP_HARDENED
+static const size_t CANARY_SIZE = sizeof(uintptr_t); // 小块内存末尾canary的字节数
+
+// ptr处内存块的canary，和地址相关，不同内存块的canary不同
+static inline uintptr_t CanaryOf(void* ptr)
+{
+	return HardenedKey() ^ ((uintptr_t)ptr * 0x9E3779B97F4A7C15ULL);
+}
+#else
+static const size_t CANARY_SIZE = 0;
+#endif
+
+#if defined(CMP_HARDENED_GUARD_PAGES) && !defined(CMP_HARDENED)
+#error "CMP_HARDENED_GUARD_PAGES需要同时定义CMP_HARDENED"
+#endif
+
+#ifdef CMP_HARDENED_GUARD_PAGES
+static const size_t GUARD_PAGES = 1; // 大块内存前后保护页的页数
+#else
+static const size_t GUARD_PAGES = 0;
+#endif
+
+// 申请size字节时实际要向内存池申请的大小，加固模式下多出放canary的空间
+static inline size_t HardenedSize(size_t size)
+{
+	return size + CANARY_SIZE;
+}
+
+// 查找ptr所在的span，加固模式下校验ptr确实是内存池分配出去的内存块的起始地址
+static inline Span* LookupSpan(void* ptr)
+{
+#ifdef CMP_HARDENED
+	Span* span = PageCache::GetInstance()->FindSpan(ptr);
+	if (span == nullptr || !span->_isUse || span->_objSize == 0) HardenedAbort("释放或访问的指针不是内存池分配的", ptr);
+
+	size_t offset = (char*)ptr - (char*)((span->_pageId + (span->_guarded ? GUARD_PAGES : 0)) << PAGE_SHIFT);
+	if (span->_objSize <= MAX_BYTES ? offset % span->_objSize != 0 : offset != 0)
+	{
+		HardenedAbort("指针不是内存块的起始地址", ptr);
+	}
+
+	return span;
+#else
+	return PageCache::GetInstance()->MapObjToSpan(ptr);
+#endif
+}
+
+// 小块内存交给用户之前调用：在位图中标记为已分配，并写入canary
+static inline void* HardenAllocation(void* ptr)
+{
+#ifdef CMP_HARDENED
+	Span* span = PageCache::GetInstance()->MapObjToSpan(ptr);
+	size_t bit = ((char*)ptr - (char*)(span->_pageId << PAGE_SHIFT)) / span->_objSize;
+	uint64_t mask = (uint64_t)1 << (bit & 63);
+	if (span->_allocBits[bit >> 6].fetch_or(mask, std::memory_order_relaxed) & mask)
+	{
+		HardenedAbort("同一个内存块被分配了两次，自由链表被破坏", ptr);
+	}
+
+	uintptr_t canary = CanaryOf(ptr);
+	memcpy((char*)ptr + span->_objSize - CANARY_SIZE, &canary, CANARY_SIZE);
+#endif
+	return ptr;
+}
+
+// 小块内存归还之前调用：检查是否重复释放、canary是否完好，并在位图中清除已分配标记
+static inline void HardenFree(void* ptr, Span* span)
+{
+#ifdef CMP_HARDENED
+	size_t bit = ((char*)ptr - (char*)(span->_pageId << PAGE_SHIFT)) / span->_objSize;
+	uint64_t mask = (uint64_t)1 << (bit & 63);
+	if (!(span->_allocBits[bit >> 6].fetch_and(~mask, std::memory_order_relaxed) & mask))
+	{
+		HardenedAbort("重复释放", ptr);
+	}
+
+	uintptr_t canary;
+	memcpy(&canary, (char*)ptr + span->_objSize - CANARY_SIZE, CANARY_SIZE);
+	if (canary != CanaryOf(ptr)) HardenedAbort("canary被改写，内存块写越界", ptr);
+#else
+	(void)ptr;
+	(void)span;
+#endif
+}
+
+// 大块内存span中用户内存的起始地址，跳过前面的保护页
+static inline void* LargeObjStart(Span* span)
+{
+#ifdef CMP_HARDENED
+	if (span->_guarded) return (void*)((span->_pageId + GUARD_PAGES) << PAGE_SHIFT);
+#endif
+	return (void*)(span->_pageId << PAGE_SHIFT);
+}
+
+// 大块内存span中用户可用的页数
+static inline size_t LargeObjPages(Span* span)
+{
+#ifdef CMP_HARDENED
+	if (span->_guarded) return span->_nPages - 2 * GUARD_PAGES;
+#endif
+	return span->_nPages;
+}
+
+// 大块内存是否有保护页，有保护页的span不能原地扩缩
+static inline bool IsGuarded(Span* span)
+{
+#ifdef CMP_HARDENED
+	return span->_guarded;
+#else
+	(void)span;
+	return false;
+#endif
+}
+
+// 把新申请的大块内存span（比用户需要的多2*GUARD_PAGES页）首尾的页设为不可访问，返回用户内存的起始地址
+static inline void* GuardLargeSpan(Span* span)
+{
+#ifdef CMP_HARDENED_GUARD_PAGES
+	char* start = (char*)(span->_pageId << PAGE_SHIFT);
+	SystemProtect(start, GUARD_PAGES, false);
+	SystemProtect(start + ((span->_nPages - GUARD_PAGES) << PAGE_SHIFT), GUARD_PAGES, false);
+	span->_guarded = true;
+	PageCache::GetInstance()->MapPage(span->_pageId + GUARD_PAGES, span);
+#endif
+	return LargeObjStart(span);
+}
+
+// 大块内存span归还给page cache之前恢复保护页的访问权限
+static inline void UnguardLargeSpan(Span* span)
+{
+#ifdef CMP_HARDENED
+	if (!span->_guarded) return;
+
+	char* start = (char*)(span->_pageId << PAGE_SHIFT);
+	SystemProtect(start, GUARD_PAGES, true);
+	SystemProtect(start + ((span->_nPages - GUARD_PAGES) << PAGE_SHIFT), GUARD_PAGES, true);
+	span->_guarded = false;
+
+	// 超过128页的span归还后只清除首页的映射，这里清除GuardLargeSpan补上的映射
+	if (span->_nPages > N_PAGES - 1) PageCache::GetInstance()->MapPage(span->_pageId + GUARD_PAGES, nullptr);
+#else
+	(void)span;
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,269 @@
+#pragma once
+
+#include "Common.hpp"
+#include "ObjectPool.hpp"
+#include "PageCache.hpp"
+#include <cmath>
+#include <cstdio>
+
+// 定义CMP_HEAP_PROFILER后开启采样式堆分析
+// 平均每申请HEAP_SAMPLE_RATE字节采样一次（采样间隔服从指数分布，即按字节的几何分布），
+// 被采样的申请记录调用栈，可以随时导出pprof能够解析的heap profile（heap_v2格式），
+// 没有被采样的申请只需要对线程局部的计数器做一次减法
+#ifdef CMP_HEAP_PROFILER
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <execinfo.h>
+#endif
+
+static const size_t HEAP_SAMPLE_RATE = 512 * 1024; // 默认平均采样间隔，512KB
+static const int MAX_STACK_DEPTH = 32;             // 采样记录的最大调用栈深度
+static const size_t SAMPLE_BUCKETS = 4096;         // 采样记录哈希表的桶数
+
+inline thread_local int64_t tlsBytesUntilSample = 0; // 距离下一次采样还需要申请的字节数
+inline thread_local bool tlsSamplerInit = false;     // 当前线程是否已经初始化了采样间隔
+inline thread_local bool tlsInProfiler = false;      // 当前线程是否正在执行采样逻辑，避免采样过程中申请内存时重入
+inline thread_local uint64_t tlsSampleRand = 0;      // 当前线程的随机数状态
+
+// 单例模式--懒汉模式
+class HeapProfiler
+{
+public:
+	static HeapProfiler* GetInstance()
+	{
+		// 同PageCache，第一次使用时构造，永不析构
+		alignas(HeapProfiler) static char storage[sizeof(HeapProfiler)];
+		static HeapProfiler* instance = new(storage)HeapProfiler;
+		return instance;
+	}
+
+	// 设置平均采样间隔（字节），0表示关闭采样，已有的采样记录不受影响
+	void SetSampleRate(size_t bytes) { _sampleRate.store(bytes, std::memory_order_relaxed); }
+
+	size_t GetSampleRate() { return _sampleRate.load(std::memory_order_relaxed); }
+
+	// 计数器减到0以下时调用：记录这次申请的调用栈，并重新生成下一次的采样间隔
+	void SampleAllocation(void* ptr, size_t size)
+	{
+		if (tlsInProfiler) return;
+		tlsInProfiler = true;
+
+		// 线程第一次进入时只生成采样间隔，不采样，避免每个线程的第一次申请都被采到
+		if (tlsSamplerInit && GetSampleRate() > 0)
+		{
+			Sample sample;
+			sample._ptr = ptr;
+			sample._size = size;
+			sample._depth = CaptureStack(sample._stack);
+			Insert(sample);
+		}
+
+		tlsSamplerInit = true;
+		tlsBytesUntilSample = NextSampleInterval();
+		tlsInProfiler = false;
+	}
+
+	// 释放的内存块所在span中有被采样的内存块时调用，删除对应的采样记录
+	void RecordFree(void* ptr, Span* span)
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+
+		Sample** prev = &_buckets[Hash(ptr)];
+		for (Sample* it = *prev; it != nullptr; prev = &it->_next, it = it->_next)
+		{
+			if (it->_ptr == ptr)
+			{
+				*prev = it->_next;
+				_samplePool.Delete(it);
+				--_nSamples;
+				span->_sampledObjs.fetch_sub(1, std::memory_order_relaxed);
+				return;
+			}
+		}
+	}
+
+	// fork前加锁、fork后在父子进程中解锁
+	void Lock() { _mtx.lock(); }
+
+	void Unlock() { _mtx.unlock(); }
+
+	// 导出当前仍然存活的采样记录，格式为pprof的legacy heap profile（heap_v2）
+	// 写文件过程中可能申请内存，所以先把采样记录拷贝出来，写文件时不持有锁
+	bool DumpHeapProfile(const char* path)
+	{
+		bool inProfiler = tlsInProfiler;
+		tlsInProfiler = true;
+
+		Sample* copy = nullptr;
+		size_t n = 0, pages = 0;
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			if (_nSamples > 0)
+			{
+				pages = SizeClass::_RoundUp(_nSamples * sizeof(Sample), 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+				copy = (Sample*)SystemAlloc(pages);
+				for (size_t i = 0; i < SAMPLE_BUCKETS && copy != nullptr; ++i)
+				{
+					for (Sample* it = _buckets[i]; it != nullptr; it = it->_next)
+					{
+						copy[n++] = *it;
+					}
+				}
+			}
+		}
+
+		// 采样记录拷贝不出来时不写一个不完整的文件
+		bool ok = (pages == 0 || copy != nullptr) && WriteProfile(path, copy, n);
+
+		if (copy) SystemFree(copy, pages);
+		tlsInProfiler = inProfiler;
+
+		return ok;
+	}
+
+private:
+	struct Sample
+	{
+		void* _ptr = nullptr;             // 被采样的内存块
+		size_t _size = 0;                 // 申请的字节数
+		int _depth = 0;                   // 调用栈深度
+		void* _stack[MAX_STACK_DEPTH];    // 调用栈
+		Sample* _next = nullptr;          // 哈希桶中的下一个记录
+	};
+
+	static size_t Hash(void* ptr)
+	{
+		return (size_t)(((uint64_t)((uintptr_t)ptr >> 3) * 0x9E3779B97F4A7C15ull) >> 52) & (SAMPLE_BUCKETS - 1);
+	}
+
+	void Insert(const Sample& sample)
+	{
+		Span* span = PageCache::GetInstance()->MapObjToSpan(sample._ptr);
+
+		std::lock_guard<std::mutex> lock(_mtx);
+
+		// 内存不足时放弃这条采样记录，不能在锁内抛异常；span上不计数，释放时也就不会去查找它
+		Sample* record = _samplePool.New();
+		if (record == nullptr) return;
+
+		*record = sample;
+
+		size_t bucket = Hash(sample._ptr);
+		record->_next = _buckets[bucket];
+		_buckets[bucket] = record;
+		++_nSamples;
+
+		span->_sampledObjs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// 按指数分布生成下一次采样前要申请的字节数，均值为采样间隔
+	int64_t NextSampleInterval()
+	{
+		size_t rate = GetSampleRate();
+		if (rate == 0) return INT64_MAX;
+
+		// xorshift64*，种子取线程局部变量的地址和时间
+		if (tlsSampleRand == 0) tlsSampleRand = ((uintptr_t)&tlsSampleRand ^ NowMs()) | 1;
+		tlsSampleRand ^= tlsSampleRand >> 12;
+		tlsSampleRand ^= tlsSampleRand << 25;
+		tlsSampleRand ^= tlsSampleRand >> 27;
+		uint64_t r = tlsSampleRand * 0x2545F4914F6CDD1Dull;
+
+		double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+		double interval = -std::log(u) * (double)rate;
+
+		return interval > (double)INT64_MAX / 2 ? INT64_MAX / 2 : (int64_t)interval + 1;
+	}
+
+	static int CaptureStack(void** stack)
+	{
+#ifdef _WIN32
+		return CaptureStackBackTrace(2, MAX_STACK_DEPTH, stack, nullptr);
+#else
+		return backtrace(stack, MAX_STACK_DEPTH);
+#endif
+	}
+
+	bool WriteProfile(const char* path, const Sample* samples, size_t n)
+	{
+		FILE* fp = fopen(path, "w");
+		if (fp == nullptr) return false;
+
+		size_t totalBytes = 0;
+		for (size_t i = 0; i < n; ++i) totalBytes += samples[i]._size;
+
+		fprintf(fp, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", n, totalBytes, n, totalBytes, GetSampleRate());
+		for (size_t i = 0; i < n; ++i)
+		{
+			fprintf(fp, "%zu: %zu [%zu: %zu] @", (size_t)1, samples[i]._size, (size_t)1, samples[i]._size);
+			for (int d = 0; d < samples[i]._depth; ++d)
+			{
+				fprintf(fp, " %p", samples[i]._stack[d]);
+			}
+			fprintf(fp, "\n");
+		}
+
+#ifndef _WIN32
+		// pprof通过MAPPED_LIBRARIES把地址解析到对应的可执行文件和动态库
+		fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+		FILE* maps = fopen("/proc/self/maps", "r");
+		if (maps)
+		{
+			char buf[4096];
+			size_t len = 0;
+			while ((len = fread(buf, 1, sizeof(buf), maps)) > 0)
+			{
+				fwrite(buf, 1, len, fp);
+			}
+			fclose(maps);
+		}
+#endif
+
+		fclose(fp);
+		return true;
+	}
+
+private:
+	std::atomic<size_t> _sampleRate{ HEAP_SAMPLE_RATE }; // 平均采样间隔
+	std::mutex _mtx;                                     // 保护采样记录哈希表
+	Sample* _buckets[SAMPLE_BUCKETS] = {};               // 采样记录哈希表，按内存块地址散列
+	ObjectPool<Sample> _samplePool;                      // 采样记录的定长内存池，不经过被分析的内存池
+	size_t _nSamples = 0;                                // 存活的采样记录数
+
+private:
+	HeapProfiler() {}
+
+	HeapProfiler(const HeapProfiler&) = delete;
+};
+
+#endif
+
+// 申请成功后调用：未开启堆分析或没有到采样点时只做一次计数器减法
+static inline void* SampleAllocation(void* ptr, size_t size)
+{
+#ifdef CMP_HEAP_PROFILER
+	if ((tlsBytesUntilSample -= (int64_t)size) < 0)
+	{
+		HeapProfiler::GetInstance()->SampleAllocation(ptr, size);
+	}
+#else
+	(void)size;
+#endif
+	return ptr;
+}
+
+// 释放前调用：span中有被采样的内存块时才去查采样记录
+static inline void RecordFree(void* ptr, Span* span)
+{
+#ifdef CMP_HEAP_PROFILER
+	if (span->_sampledObjs.load(std::memory_order_relaxed) > 0)
+	{
+		HeapProfiler::GetInstance()->RecordFree(ptr, span);
+	}
+#else
+	(void)ptr;
+	(void)span;
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,161 @@
+// 编译成libcmpool.so后，通过LD_PRELOAD替换程序中的malloc/free系列函数和全局operator new/delete
+// 例如：LD_PRELOAD=./libcmpool.so ./main，程序不需要修改代码就能使用内存池
+#define CMP_OVERRIDE_NEW_DELETE
+#include "ConcurrentAlloc.hpp"
+#include <cerrno>
+#include <malloc.h>
+
+static bool IsPowerOfTwo(size_t n)
+{
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+extern "C"
+{
+	// 内存池内部持有锁时不抛异常，失败时返回nullptr，这里在所有锁都释放之后再设置errno
+	void* malloc(size_t size)
+	{
+		void* ptr = ConcurrentAllocNothrow(size == 0 ? 1 : size);
+		if (ptr == nullptr) errno = ENOMEM;
+
+		return ptr;
+	}
+
+	void free(void* ptr)
+	{
+		if (ptr) ConcurrentFree(ptr);
+	}
+
+	void* calloc(size_t n, size_t size)
+	{
+		size_t bytes = n * size;
+		if (size != 0 && bytes / size != n)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+
+		void* ptr = malloc(bytes);
+		if (ptr) memset(ptr, 0, bytes);
+
+		return ptr;
+	}
+
+	void* realloc(void* ptr, size_t size)
+	{
+		if (ptr == nullptr) return malloc(size);
+		if (size == 0)
+		{
+			free(ptr);
+			return nullptr;
+		}
+
+		void* newPtr = ConcurrentReallocNothrow(ptr, size);
+		if (newPtr == nullptr) errno = ENOMEM; // 申请失败时原来的内存保持不变
+
+		return newPtr;
+	}
+
+	void* memalign(size_t align, size_t size)
+	{
+		if (!IsPowerOfTwo(align))
+		{
+			errno = EINVAL;
+			return nullptr;
+		}
+
+		void* ptr = ConcurrentAllocAlignedNothrow(size == 0 ? 1 : size, align);
+		if (ptr == nullptr) errno = ENOMEM;
+
+		return ptr;
+	}
+
+	int posix_memalign(void** memptr, size_t align, size_t size)
+	{
+		if (!IsPowerOfTwo(align) || align % sizeof(void*) != 0) return EINVAL;
+
+		void* ptr = memalign(align, size);
+		if (ptr == nullptr) return ENOMEM;
+
+		*memptr = ptr;
+		return 0;
+	}
+
+	void* aligned_alloc(size_t align, size_t size)
+	{
+		return memalign(align, size);
+	}
+
+	void* valloc(size_t size)
+	{
+		return memalign(sysconf(_SC_PAGESIZE), size);
+	}
+
+	void* pvalloc(size_t size)
+	{
+		size_t pageSize = sysconf(_SC_PAGESIZE);
+		if (size > MAX_ALLOC_BYTES) // 向上取整到页大小时不能溢出
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+
+		return memalign(pageSize, SizeClass::_RoundUp(size == 0 ? 1 : size, pageSize));
+	}
+
+	size_t malloc_usable_size(void* ptr)
+	{
+		return ptr ? ConcurrentUsableSize(ptr) : 0;
+	}
+}
+
+// C++17带对齐参数的operator new/delete
+void* operator new(size_t size, std::align_val_t align)
+{
+	return ConcurrentAllocAligned(size == 0 ? 1 : size, (size_t)align);
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+	return ConcurrentAllocAligned(size == 0 ? 1 : size, (size_t)align);
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	return memalign((size_t)align, size);
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	return memalign((size_t)align, size);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	if (ptr) ConcurrentFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+	if (ptr) ConcurrentFree(ptr);
+}
+
+void operator delete(void* ptr, size_t size, std::align_val_t align) noexcept
+{
+	if (ptr) ConcurrentFreeAligned(ptr, size == 0 ? 1 : size, (size_t)align);
+}
+
+void operator delete[](void* ptr, size_t size, std::align_val_t align) noexcept
+{
+	if (ptr) ConcurrentFreeAligned(ptr, size == 0 ? 1 : size, (size_t)align);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	if (ptr) ConcurrentFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	if (ptr) ConcurrentFree(ptr);
+}
\ No newline at end of file
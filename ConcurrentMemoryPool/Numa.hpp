@@ -0,0 +1,163 @@
+#pragma once
+
+#include "Common.hpp"
+
+#ifdef __linux__
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#endif
+
+static const size_t MAX_NUMA_NODES = 8; // 支持的NUMA节点数上限，编号更大的节点折叠到[0, MAX_NUMA_NODES)
+static const size_t MAX_CPUS = 1024;    // 记录CPU所属节点的CPU编号上限
+
+// NUMA拓扑：CPU编号到NUMA节点的映射
+// Linux下读取/sys/devices/system/node/nodeN/cpulist；设置了环境变量CMP_NUMA_TOPOLOGY时改用其中描述的假拓扑，
+// 格式和cpulist相同，节点之间用分号分隔，例如"0-3,8-11;4-7,12-15"表示两个节点，用于在单节点机器上模拟多节点
+// 读取拓扑时可能正处在malloc中，所以只使用open/read和栈上的缓冲区，不申请内存
+// 单例模式--懒汉模式
+class NumaTopology
+{
+public:
+	static NumaTopology* GetInstance()
+	{
+		// 同PageCache，第一次使用时构造，永不析构
+		alignas(NumaTopology) static char storage[sizeof(NumaTopology)];
+		static NumaTopology* instance = new(storage)NumaTopology;
+		return instance;
+	}
+
+	size_t NumNodes() { return _nNodes; }
+
+	bool IsFake() { return _fake; }
+
+	size_t NodeOfCpu(size_t cpu) { return cpu < MAX_CPUS ? _cpuNode[cpu] : 0; }
+
+	// 当前线程所在CPU的NUMA节点
+	size_t CurrentNode() { return NodeOfCpu(CurrentCpu()); }
+
+	// 当前线程所在的CPU，取不到时返回0
+	static size_t CurrentCpu()
+	{
+#ifdef _WIN32
+		return GetCurrentProcessorNumber();
+#elif defined(__linux__)
+		int cpu = sched_getcpu();
+		return cpu < 0 ? 0 : (size_t)cpu;
+#else
+		return 0;
+#endif
+	}
+
+	// 让[ptr, ptr+bytes)的物理页优先从node节点分配，在第一次访问缺页时生效
+	// 只有真实的多节点拓扑才调用mbind，假拓扑和单节点时什么都不做
+	void BindToNode(void* ptr, size_t bytes, size_t node)
+	{
+#ifdef __linux__
+		if (_fake || _nNodes <= 1) return;
+
+		const int MPOL_PREFERRED_MODE = 1; // linux/mempolicy.h中的MPOL_PREFERRED
+		unsigned long mask = 1UL << _nodeIds[node];
+		syscall(SYS_mbind, ptr, bytes, MPOL_PREFERRED_MODE, &mask, sizeof(mask) * 8, 0);
+#endif
+	}
+
+private:
+	// 解析"0-3,8-11"格式的CPU列表，把其中的CPU都标记为属于node节点
+	void ParseCpuList(const char* s, const char* end, size_t node)
+	{
+		while (s < end)
+		{
+			if (*s < '0' || *s > '9') { ++s; continue; }
+
+			size_t first = 0;
+			while (s < end && *s >= '0' && *s <= '9') first = first * 10 + (*s++ - '0');
+
+			size_t last = first;
+			if (s < end && *s == '-')
+			{
+				++s;
+				last = 0;
+				while (s < end && *s >= '0' && *s <= '9') last = last * 10 + (*s++ - '0');
+			}
+
+			for (size_t cpu = first; cpu <= last && cpu < MAX_CPUS; ++cpu)
+			{
+				_cpuNode[cpu] = (uint8_t)node;
+			}
+		}
+	}
+
+	// 解析假拓扑，每个分号分隔的段是一个节点
+	void LoadFakeTopology(const char* spec)
+	{
+		_fake = true;
+		_nNodes = 0;
+
+		const char* s = spec;
+		while (true)
+		{
+			const char* end = s;
+			while (*end != '\0' && *end != ';') ++end;
+
+			if (_nNodes < MAX_NUMA_NODES)
+			{
+				_nodeIds[_nNodes] = (int)_nNodes;
+				ParseCpuList(s, end, _nNodes);
+				++_nNodes;
+			}
+
+			if (*end == '\0') break;
+			s = end + 1;
+		}
+	}
+
+	// 读取sysfs中的真实拓扑，没有NUMA信息时保持单节点
+	void LoadSysTopology()
+	{
+#ifdef __linux__
+		size_t nNodes = 0;
+		for (int id = 0; id < 64 && nNodes < MAX_NUMA_NODES; ++id)
+		{
+			char path[64];
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+
+			int fd = open(path, O_RDONLY);
+			if (fd < 0) continue;
+
+			char buf[4096];
+			ssize_t len = read(fd, buf, sizeof(buf));
+			close(fd);
+			if (len <= 0) continue;
+
+			_nodeIds[nNodes] = id;
+			ParseCpuList(buf, buf + len, nNodes);
+			++nNodes;
+		}
+
+		if (nNodes > 0) _nNodes = nNodes;
+#endif
+	}
+
+private:
+	uint8_t _cpuNode[MAX_CPUS] = {};     // CPU编号 -> 节点下标
+	int _nodeIds[MAX_NUMA_NODES] = {};   // 节点下标 -> 系统中的节点编号，mbind使用
+	size_t _nNodes = 1;                  // 节点数
+	bool _fake = false;                  // 是否使用环境变量描述的假拓扑
+
+private:
+	NumaTopology()
+	{
+		const char* spec = getenv("CMP_NUMA_TOPOLOGY");
+		if (spec != nullptr && *spec != '\0')
+		{
+			LoadFakeTopology(spec);
+		}
+		else
+		{
+			LoadSysTopology();
+		}
+	}
+
+	NumaTopology(const NumaTopology&) = delete;
+};
\ No newline at end of file
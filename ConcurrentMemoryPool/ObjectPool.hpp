@@ -2,6 +2,7 @@
 
 #include "Common.hpp"
 
+// 单线程的定长内存池，向系统申请内存失败时New返回nullptr
 template<class T>
 class ObjectPool
 {
@@ -21,9 +22,9 @@ public:
             if (_remainingBytes < sizeof(T)) // 内存块剩余的字节小于T的大小
             {
                 // 调用SystemAlloc申请大块内存
+                _memory = (char*)SystemAlloc((128 * 1024) >> PAGE_SHIFT);
+                if (_memory == nullptr) return nullptr;
                 _remainingBytes = 128 * 1024;
-                _memory = (char*)SystemAlloc(_remainingBytes >> 13);
-                if (_memory == nullptr) throw std::bad_alloc();
             }
 
             obj = (T*)_memory;
@@ -52,4 +53,366 @@ private:
     char* _memory = nullptr;    // 指向内存块的指针
     size_t _remainingBytes = 0; // 内存块中剩下的字节数
     void* _freeList = nullptr;  // 管理归还的内存的自由链表
+};
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+static const size_t POOL_MAGAZINE_SIZE = 32;   // 线程本地弹匣最多缓存的对象个数
+static const size_t POOL_MAGAZINE_BYTES = 64 * 1024; // 大对象的弹匣按字节数限制个数
+static const size_t MAX_CONCURRENT_POOLS = 32; // 可以使用线程本地弹匣的池的个数，超过的池退回到加锁的共享弹匣
+
+// 一批空闲对象：对象之间通过头一个指针串成链表，放入全局仓库时在批次的第一个对象中记录下一批和本批的个数
+struct PoolBatch
+{
+    void* _nextObj;        // 和NextObj重叠，批次内的下一个对象
+    PoolBatch* _nextBatch; // 全局仓库中的下一批
+    size_t _count;         // 本批的对象个数
+};
+
+// 弹匣：一串空闲对象
+struct PoolMagazine
+{
+    uint64_t _gen = 0;      // 所属池的代号，槽位被新的池复用后，旧池留下的对象据此丢弃
+    void* _head = nullptr;  // 空闲对象链表
+    size_t _count = 0;      // 空闲对象个数
+};
+
+// 每个线程的弹匣，按池的槽位下标访问
+struct PoolThreadState
+{
+    PoolMagazine _mags[MAX_CONCURRENT_POOLS];
+    bool _registered = false; // 是否已经登记了线程退出时的归还
+};
+
+// inline变量：包含这个头文件的所有编译单元共用同一份，线程退出回调只登记一个
+inline thread_local PoolThreadState tlsPoolState;
+
+// 线程安全的定长内存池的实现，不区分类型，只管理objSize大小的内存块
+// 每个线程有自己的弹匣，申请和释放通常只操作弹匣；弹匣空了从全局仓库取一整批，满了把整批放回全局仓库，
+// 全局仓库是无锁的栈（Treiber stack），栈顶指针带版本号避免ABA；仓库也空了才加锁从大块内存中切一批
+// 线程退出时弹匣中的对象归还到全局仓库；池析构时把大块内存还给系统，此时池中的对象必须都已经释放
+class ConcurrentObjectPoolBase
+{
+public:
+    ConcurrentObjectPoolBase(size_t objSize, size_t objAlign)
+    {
+        // 对象至少要放得下PoolBatch，并按对象的对齐要求取整
+        objAlign = std::max(objAlign, alignof(PoolBatch));
+        _objSize = SizeClass::_RoundUp(std::max(objSize, sizeof(PoolBatch)), objAlign);
+        _magSize = std::max((size_t)1, std::min(POOL_MAGAZINE_SIZE, POOL_MAGAZINE_BYTES / _objSize));
+        _chunkBytes = SizeClass::_RoundUp(std::max(_objSize * _magSize * 4 + _objSize, (size_t)128 * 1024), 1 << PAGE_SHIFT);
+        _gen = _nextGen.fetch_add(1, std::memory_order_relaxed) + 1;
+
+#ifndef _WIN32
+        ThreadExitKey(); // 第一个池创建时创建线程退出回调的key
+        for (size_t i = 0; i < MAX_CONCURRENT_POOLS; ++i)
+        {
+            ConcurrentObjectPoolBase* expected = nullptr;
+            if (_registry[i].compare_exchange_strong(expected, this, std::memory_order_acq_rel))
+            {
+                _slot = i;
+                break;
+            }
+        }
+#endif
+    }
+
+    ~ConcurrentObjectPoolBase()
+    {
+        if (_slot < MAX_CONCURRENT_POOLS)
+        {
+            _registry[_slot].store(nullptr, std::memory_order_release);
+        }
+
+        // 大块内存的头部记录下一块大块内存的地址
+        while (_chunks)
+        {
+            void* next = NextObj(_chunks);
+            SystemFree(_chunks, _chunkBytes >> PAGE_SHIFT);
+            _chunks = next;
+        }
+    }
+
+    // 向系统申请内存失败时返回nullptr
+    void* Allocate()
+    {
+        PoolMagazine* mag = LocalMagazine();
+        if (mag == nullptr)
+        {
+            std::lock_guard<SpinLock> lock(_sharedLock);
+            return AllocateFrom(_sharedMag);
+        }
+
+        return AllocateFrom(*mag);
+    }
+
+    // fork前加锁、fork后在父子进程中解锁，加锁顺序同Allocate：先共用弹匣的锁，再切分大块内存的锁
+    void LockAll()
+    {
+        _sharedLock.lock();
+        _chunkLock.lock();
+    }
+
+    void UnlockAll()
+    {
+        _chunkLock.unlock();
+        _sharedLock.unlock();
+    }
+
+    void Deallocate(void* obj)
+    {
+        PoolMagazine* mag = LocalMagazine();
+        if (mag == nullptr)
+        {
+            std::lock_guard<SpinLock> lock(_sharedLock);
+            DeallocateTo(_sharedMag, obj);
+            return;
+        }
+
+        DeallocateTo(*mag, obj);
+    }
+
+private:
+    void* AllocateFrom(PoolMagazine& mag)
+    {
+        if (mag._count == 0 && !Refill(mag)) return nullptr;
+
+        void* obj = mag._head;
+        mag._head = NextObj(obj);
+        --mag._count;
+
+        return obj;
+    }
+
+    void DeallocateTo(PoolMagazine& mag, void* obj)
+    {
+        // 弹匣满了，把整个弹匣放入全局仓库
+        if (mag._count == _magSize)
+        {
+            PushBatch(mag._head, mag._count);
+            mag._head = nullptr;
+            mag._count = 0;
+        }
+
+        NextObj(obj) = mag._head;
+        mag._head = obj;
+        ++mag._count;
+    }
+
+    // 弹匣空了：优先从全局仓库取一批，没有再从大块内存中切一批，一个也取不到时返回false
+    bool Refill(PoolMagazine& mag)
+    {
+        PoolBatch* batch = PopBatch();
+        if (batch)
+        {
+            mag._head = batch;
+            mag._count = batch->_count;
+            return true;
+        }
+
+        std::lock_guard<SpinLock> lock(_chunkLock);
+        for (size_t i = 0; i < _magSize; ++i)
+        {
+            if (_remainingBytes < _objSize)
+            {
+                // 大块内存的头部留出一个对象的位置，记录大块内存的链表
+                char* chunk = (char*)SystemAlloc(_chunkBytes >> PAGE_SHIFT);
+                if (chunk == nullptr) break;
+
+                NextObj(chunk) = _chunks;
+                _chunks = chunk;
+                _memory = chunk + _objSize;
+                _remainingBytes = _chunkBytes - _objSize;
+            }
+
+            NextObj(_memory) = mag._head;
+            mag._head = _memory;
+            ++mag._count;
+            _memory += _objSize;
+            _remainingBytes -= _objSize;
+        }
+
+        return mag._count > 0;
+    }
+
+    // 版本号放在指针不用的高位：64位下用户态地址只有48位，32位下放在高32位
+    static uint64_t Pack(PoolBatch* batch, uint64_t tag)
+    {
+#if UINTPTR_MAX == UINT64_MAX
+        return (uint64_t)(uintptr_t)batch | (tag << 48);
+#else
+        return (uint64_t)(uintptr_t)batch | (tag << 32);
+#endif
+    }
+
+    static PoolBatch* Unpack(uint64_t top)
+    {
+#if UINTPTR_MAX == UINT64_MAX
+        return (PoolBatch*)(uintptr_t)(top & (((uint64_t)1 << 48) - 1));
+#else
+        return (PoolBatch*)(uintptr_t)(uint32_t)top;
+#endif
+    }
+
+    static uint64_t NextTag(uint64_t top)
+    {
+#if UINTPTR_MAX == UINT64_MAX
+        return (top >> 48) + 1;
+#else
+        return (top >> 32) + 1;
+#endif
+    }
+
+    void PushBatch(void* head, size_t count)
+    {
+        PoolBatch* batch = (PoolBatch*)head;
+        batch->_count = count;
+
+        uint64_t top = _depot.load(std::memory_order_relaxed);
+        do
+        {
+            batch->_nextBatch = Unpack(top);
+        } while (!_depot.compare_exchange_weak(top, Pack(batch, NextTag(top)), std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    PoolBatch* PopBatch()
+    {
+        uint64_t top = _depot.load(std::memory_order_acquire);
+        while (PoolBatch* batch = Unpack(top))
+        {
+            // batch可能刚被其他线程取走并重新使用，读到的_nextBatch是旧值时版本号已经变了，CAS会失败
+            PoolBatch* next = batch->_nextBatch;
+            if (_depot.compare_exchange_weak(top, Pack(next, NextTag(top)), std::memory_order_acquire, std::memory_order_acquire))
+            {
+                return batch;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // 当前线程在这个池的弹匣，没有槽位时返回nullptr
+    PoolMagazine* LocalMagazine()
+    {
+        if (_slot >= MAX_CONCURRENT_POOLS) return nullptr;
+
+        PoolThreadState& state = tlsPoolState;
+#ifndef _WIN32
+        if (!state._registered)
+        {
+            // 值非空时线程退出会调用回调；前32个key的值存放在线程描述符内，设置时不会申请内存
+            pthread_setspecific(ThreadExitKey(), &state);
+            state._registered = true;
+        }
+#endif
+
+        PoolMagazine& mag = state._mags[_slot];
+        if (mag._gen != _gen)
+        {
+            // 槽位之前属于一个已经析构的池，丢弃它留下的对象
+            mag._gen = _gen;
+            mag._head = nullptr;
+            mag._count = 0;
+        }
+
+        return &mag;
+    }
+
+#ifndef _WIN32
+    static pthread_key_t ThreadExitKey()
+    {
+        static pthread_key_t key = [] {
+            pthread_key_t k;
+            pthread_key_create(&k, FlushThreadMagazines);
+            return k;
+        }();
+        return key;
+    }
+
+    // 线程退出时把所有弹匣中的对象放回对应池的全局仓库
+    static void FlushThreadMagazines(void* arg)
+    {
+        PoolThreadState* state = (PoolThreadState*)arg;
+        for (size_t i = 0; i < MAX_CONCURRENT_POOLS; ++i)
+        {
+            PoolMagazine& mag = state->_mags[i];
+            if (mag._count == 0) continue;
+
+            ConcurrentObjectPoolBase* pool = _registry[i].load(std::memory_order_acquire);
+            if (pool && pool->_gen == mag._gen)
+            {
+                pool->PushBatch(mag._head, mag._count);
+            }
+            mag._head = nullptr;
+            mag._count = 0;
+        }
+
+        // 退出过程中再使用池会重新登记，pthread会再次调用回调
+        state->_registered = false;
+    }
+#endif
+
+private:
+    size_t _objSize = 0;                   // 对齐后的对象大小
+    size_t _magSize = 0;                   // 弹匣的容量
+    size_t _chunkBytes = 0;                // 每次向系统申请的大块内存的字节数
+    size_t _slot = MAX_CONCURRENT_POOLS;   // 在注册表中的槽位，也是线程弹匣的下标
+    uint64_t _gen = 0;                     // 池的代号，全局唯一
+    std::atomic<uint64_t> _depot{ 0 };     // 全局仓库的栈顶：带版本号的PoolBatch指针
+
+    SpinLock _chunkLock;                   // 保护下面切分大块内存的字段
+    char* _memory = nullptr;               // 当前大块内存中未切分部分的起始地址
+    size_t _remainingBytes = 0;            // 当前大块内存中未切分的字节数
+    void* _chunks = nullptr;               // 所有大块内存的链表，析构时归还给系统
+
+    SpinLock _sharedLock;                  // 没有槽位时所有线程共用一个弹匣
+    PoolMagazine _sharedMag;
+
+    inline static std::atomic<ConcurrentObjectPoolBase*> _registry[MAX_CONCURRENT_POOLS]; // 槽位 -> 池
+    inline static std::atomic<uint64_t> _nextGen{ 0 };
+};
+
+// 线程安全的定长内存池，多个线程可以并发地New和Delete，对象可以在一个线程New、在另一个线程Delete
+template<class T>
+class ConcurrentObjectPool
+{
+public:
+    ConcurrentObjectPool()
+        :_pool(sizeof(T), alignof(T))
+    {}
+
+    template<class... Args>
+    T* New(Args&&... args)
+    {
+        void* obj = _pool.Allocate();
+        if (obj == nullptr) throw std::bad_alloc();
+
+        // 定位new，显示调用T的构造函数初始化
+        return new(obj)T(std::forward<Args>(args)...);
+    }
+
+    // 同New，向系统申请内存失败时返回nullptr，不抛异常，内存池内部在malloc的路径上使用
+    T* TryNew()
+    {
+        void* obj = _pool.Allocate();
+        if (obj == nullptr) return nullptr;
+
+        return new(obj)T;
+    }
+
+    void Delete(T* obj)
+    {
+        // 显示调用T的析构函数清理T对象中的资源
+        obj->~T();
+        _pool.Deallocate(obj);
+    }
+
+    void LockAll() { _pool.LockAll(); }
+
+    void UnlockAll() { _pool.UnlockAll(); }
+
+private:
+    ConcurrentObjectPoolBase _pool;
 };
\ No newline at end of file
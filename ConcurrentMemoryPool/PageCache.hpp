@@ -1,214 +1,226 @@
 #pragma once
 
 #include "Common.hpp"
-#include "ObjectPool.hpp"
-#include "PageMap.hpp"
+#include "PageHeap.hpp"
+#include "Numa.hpp"
 
+static const size_t PAGE_HEAP_SHARDS = 8; // page cache的分片数
+
+// page cache按CPU分成多个PageHeap分片，每个分片一把锁，不同CPU上的线程申请、归还span时不会争同一把锁
+// span从哪个分片申请就归还到哪个分片；页号到span的全局映射由所有分片共享，查找不需要加锁
+// 分片平均分给各个NUMA节点，节点内再按CPU选分片，每个分片新申请的内存都绑定到它所属的节点
+// 下面的接口都在内部给对应的分片加锁，调用方不需要持有任何锁
 class PageCache
 {
 public:
-	static PageCache* GetInstance() { return &_singleInstance; }
-
-	std::mutex& GetMutex() { return _pageMtx; }
+	static PageCache* GetInstance()
+	{
+		// 第一次使用时在静态存储上构造，并且永不析构
+		// 替换了malloc后，内存池可能在全局对象构造之前、析构之后被调用，不能依赖全局对象的构造顺序
+		alignas(PageCache) static char storage[sizeof(PageCache)];
+		static PageCache* instance = new(storage)PageCache;
+		return instance;
+	}
 
 	// 通过小内存块得到映射的span对象
+	// 基数树的节点只增不删，查找不需要加锁
 	Span* MapObjToSpan(void* obj)
 	{
-		PAGE_ID id = ((PAGE_ID)obj >> PAGE_SHIFT);
-
-		/*std::unique_lock<std::mutex> lock(_pageMtx);
-
-		auto ret = _idSpanMap.find(id);
-		if (ret != _idSpanMap.end())
-		{
-			return ret->second;
-		}
-		else
-		{
-			assert(false);
-			return nullptr;
-		}*/
-		auto ret = (Span*)_idSpanMap.get(id);
+		auto ret = FindSpan(obj);
 		assert(ret != nullptr);
 		return ret;
 	}
 
-	// 获取一个nPages页的Span对象
+	// 同MapObjToSpan，ptr不在内存池管理的页中时返回nullptr，用于校验外来的指针
+	Span* FindSpan(void* ptr)
+	{
+		return (Span*)_idSpanMap.get((PAGE_ID)ptr >> PAGE_SHIFT);
+	}
+
+	// 把页号pageId也映射到正在使用的span：超过128页的span只映射了首页，带保护页时用户内存从第二页开始
+	// pageId所在的基数树节点在申请span时已经准备好，不需要加锁
+	void MapPage(PAGE_ID pageId, Span* span)
+	{
+		_idSpanMap.set(pageId, span);
+	}
+
+	// 从当前CPU对应的分片获取一个nPages页的Span对象，返回的span已经置为使用状态，失败时返回nullptr
 	Span* GetSpan(size_t nPages)
 	{
-		assert(nPages > 0);
+		return GetSpan(nPages, NumaTopology::GetInstance()->CurrentNode());
+	}
 
-		// 申请的页数大于128页
-		if (nPages > N_PAGES - 1)
-		{
-			// 直接向系统申请内存空间
-			void* ptr = SystemAlloc(nPages);
-			Span* span = _spanPool.New();
-			span->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
-			span->_nPages = nPages;
+	// 从node节点的分片中获取一个nPages页的Span对象，向系统申请内存失败时返回nullptr
+	Span* GetSpan(size_t nPages, size_t node)
+	{
+		PageHeap& heap = _heaps[ShardOf(node)];
+		SpanReserve reserve(PageHeap::SpanReserveSize(nPages)); // 在锁外准备span对象，锁释放后归还没用完的
+		if (!reserve.Filled()) return nullptr;
 
-			//_idSpanMap[span->_pageId] = span;
-			_idSpanMap.set(span->_pageId, span);
+		std::lock_guard<std::mutex> lock(heap.GetMutex());
+		return heap.GetSpan(nPages, reserve);
+	}
 
-			return span;
-		}
+	// 获取一个nPages页、起始页号是alignPages整数倍的span，失败时返回nullptr
+	Span* GetAlignedSpan(size_t nPages, size_t alignPages)
+	{
+		PageHeap& heap = _heaps[ShardOf(NumaTopology::GetInstance()->CurrentNode())];
+		SpanReserve reserve(PageHeap::SpanReserveSize(nPages + alignPages - 1) + 2);
+		if (!reserve.Filled()) return nullptr;
 
-		// 先检查第nPages个SpanList中有没有span
-		if (!_spanListBucket[nPages].Empty())
-		{
-			Span* nPagesSpan = _spanListBucket[nPages].PopFront();
+		std::lock_guard<std::mutex> lock(heap.GetMutex());
+		return heap.GetAlignedSpan(nPages, alignPages, reserve);
+	}
 
-			// 建立页号和span的映射关系，方便central cache回收小块内存时查找对应的span对象
-			for (PAGE_ID i = 0; i < nPagesSpan->_nPages; ++i)
-			{
-				//_idSpanMap[nPagesSpan->_pageId + i] = nPagesSpan;
-				_idSpanMap.set(nPagesSpan->_pageId + i, nPagesSpan);
-			}
+	// 把正在使用的大块内存span原地扩大到nPages页，成功返回true
+	bool GrowSpan(Span* span, size_t nPages)
+	{
+		PageHeap& heap = _heaps[span->_shard];
 
-			return nPagesSpan;
-		}
+		std::lock_guard<std::mutex> lock(heap.GetMutex());
+		return heap.GrowSpan(span, nPages);
+	}
+
+	// 归还空闲的span到它所属的分片，并合并同一分片中相邻的span
+	// 摊还式回收：距离上次回收超过间隔时，顺便把空闲超过间隔的span的物理页归还给操作系统
+	void ReleaseSpanToPageCache(Span* span)
+	{
+		PageHeap& heap = _heaps[span->_shard];
 
-		// 执行到这说明，_spanListBucket[nPages]中没有span，则检查后面的SpanList中有没有span，如果有则将大的span切割
-		// 将这个n页的span切割成一个nPages的span和一个n-nPages的span
-		// nPages的span返回给central cache，n-nPages的span挂到_spanListBucket[n - nPages]中
-		for (int i = nPages + 1; i < N_PAGES; ++i)
+		bool due = false;
+		uint64_t idleMs = 0;
 		{
-			if (!_spanListBucket[i].Empty())
-			{
-				Span* bigSpan = _spanListBucket[i].PopFront(); // 将_spanListBucket[i]中的大块的span拿出来
-				Span* nPagesSpan = _spanPool.New();
-
-				// 在大的span的头部切割一个nPages页的span
-				nPagesSpan->_pageId = bigSpan->_pageId;
-				nPagesSpan->_nPages = nPages;
-
-				// 更新完后的bigSpan就是注释中的n-nPages的span，要挂到_spanListBucket[n - nPages]中
-				bigSpan->_pageId += nPages;
-				bigSpan->_nPages -= nPages;
-
-				// 将bigSpan挂到_spanListBucket[n - nPages]中
-				_spanListBucket[bigSpan->_nPages].PushFront(bigSpan);
-
-				// 存储bigSpan的首尾页号跟bigSpan的映射，方便page cache回收内存时进行的合并查找
-				/*_idSpanMap[bigSpan->_pageId] = bigSpan;
-				_idSpanMap[bigSpan->_pageId + bigSpan->_nPages - 1] = bigSpan;*/
-				_idSpanMap.set(bigSpan->_pageId, bigSpan);
-				_idSpanMap.set(bigSpan->_pageId + bigSpan->_nPages - 1, bigSpan);
-
-				// 建立页号和span的映射关系，方便central cache回收小块内存时查找对应的span对象
-				for (PAGE_ID i = 0; i < nPagesSpan->_nPages; ++i)
-				{
-					//_idSpanMap[nPagesSpan->_pageId + i] = nPagesSpan;
-					_idSpanMap.set(nPagesSpan->_pageId + i, nPagesSpan);
-				}
-
-				return nPagesSpan;
-			}
+			std::lock_guard<std::mutex> lock(heap.GetMutex());
+			heap.ReleaseSpanToPageCache(span);
+			due = heap.ReleaseDue(idleMs);
 		}
 
-		// 代码运行到这说明，_spanListBucket[nPages]之后一直到_spanListBucket[128]都没有大块的span了
-		// 此时需要向操作系统申请一个128页的span
-		Span* newSpan = _spanPool.New();
-		void* ptr = SystemAlloc(N_PAGES - 1);
-		newSpan->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
-		newSpan->_nPages = N_PAGES - 1;
+		if (due) ReleaseIdleSpans(heap, idleMs);
+	}
 
-		// 将newSpan挂到128页的_spanListBucket[128]中
-		_spanListBucket[newSpan->_nPages].PushFront(newSpan);
+	// 把所有分片中空闲时间达到idleMs的span的物理页归还给操作系统，返回归还的页数
+	size_t ReleaseIdleSpans(uint64_t idleMs)
+	{
+		size_t releasedPages = 0;
+		for (size_t i = 0; i < PAGE_HEAP_SHARDS; ++i)
+		{
+			releasedPages += ReleaseIdleSpans(_heaps[i], idleMs);
+		}
 
-		// 递归调一次，将刚刚申请的128页的span切割成需要的nPages页的span
-		return GetSpan(nPages);
+		return releasedPages;
 	}
 
-	// 归还空闲的span到page cache，并合并相邻的span
-	void ReleaseSpanToPageCache(Span* span)
+	// 汇总所有分片的统计信息
+	void GetStats(AllocatorStats& stats)
 	{
-		// 大于128页的span直接还给堆
-		if (span->_nPages > N_PAGES - 1)
+		for (size_t i = 0; i < PAGE_HEAP_SHARDS; ++i)
 		{
-			void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
-			SystemFree(ptr);
-			_spanPool.Delete(span);
+			std::lock_guard<std::mutex> lock(_heaps[i].GetMutex());
+			_heaps[i].GetStats(stats);
+		}
+	}
 
-			return;
+	// 设置空闲span归还给操作系统的时间间隔（毫秒），0表示关闭摊还式回收
+	void SetReleaseInterval(uint64_t ms)
+	{
+		for (size_t i = 0; i < PAGE_HEAP_SHARDS; ++i)
+		{
+			std::lock_guard<std::mutex> lock(_heaps[i].GetMutex());
+			_heaps[i].SetReleaseInterval(ms);
 		}
+	}
 
-		// 对span前的页尝试进行合并
-		while (true)
+	uint64_t GetReleaseInterval()
+	{
+		std::lock_guard<std::mutex> lock(_heaps[0].GetMutex());
+		return _heaps[0].GetReleaseInterval();
+	}
+
+	// fork前按分片锁、_mapMtx的顺序加锁（同正常运行时的嵌套顺序），fork后在父子进程中解锁
+	void LockAll()
+	{
+		for (size_t i = 0; i < PAGE_HEAP_SHARDS; ++i)
 		{
-			PAGE_ID prevId = span->_pageId - 1;
-			//auto ret = _idSpanMap.find(prevId); // 查找span前面的页
+			_heaps[i].GetMutex().lock();
+		}
+		_mapMtx.lock();
+	}
 
-			//// 前面的页号没有申请到，无法合并页，break跳出循环
-			//if (ret == _idSpanMap.end()) break;
-			auto ret = (Span*)_idSpanMap.get(prevId);
-			if (ret == nullptr) break;
+	void UnlockAll()
+	{
+		_mapMtx.unlock();
+		for (size_t i = PAGE_HEAP_SHARDS; i-- > 0;)
+		{
+			_heaps[i].GetMutex().unlock();
+		}
+	}
 
-			// 前面页的span正在被使用，无法合并页，break跳出循环
-			//Span* prevSpan = ret->second;
-			Span* prevSpan = ret;
-			if (prevSpan->_isUse == true) break;
+private:
+	// 归还一个分片中空闲span的物理页：在分片锁内取出span，释放锁之后再调用madvise/munmap，
+	// 其他线程不会因为回收线程的系统调用阻塞在分片锁上
+	size_t ReleaseIdleSpans(PageHeap& heap, uint64_t idleMs)
+	{
+		Span* spans = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(heap.GetMutex());
+			spans = heap.TakeIdleSpans(idleMs);
+		}
 
-			// 合并出超过128页的span，没办法管理，无法合并页，break跳出循环
-			if (prevSpan->_nPages + span->_nPages > N_PAGES - 1) break;
+		size_t releasedPages = 0;
+		Span* released = nullptr;
+		while (spans)
+		{
+			Span* next = spans->_next;
+			releasedPages += spans->_nPages;
 
-			// 开始向前合并
-			span->_pageId = prevSpan->_pageId;
-			span->_nPages += prevSpan->_nPages;
+			if (spans->_nPages > N_PAGES - 1)
+			{
+				// 缓存的大块span整段还给系统，span对象已经不在分片中了
+				SystemFree((void*)(spans->_pageId << PAGE_SHIFT), spans->_nPages);
+				SpanPool()->Delete(spans);
+			}
+			else
+			{
+				SystemRelease((void*)(spans->_pageId << PAGE_SHIFT), spans->_nPages);
+				spans->_next = released;
+				released = spans;
+			}
 
-			_spanListBucket[prevSpan->_nPages].Erase(prevSpan); // 将prevSpan从自由链表中解下来
-			_spanPool.Delete(prevSpan);
+			spans = next;
 		}
 
-		// 对span后的页尝试进行合并
-		while (true)
+		if (released)
 		{
-			PAGE_ID nextId = span->_pageId + span->_nPages;
-			//auto ret = _idSpanMap.find(nextId);
-			//
-			//// 后面的页号没有申请到，无法合并页，break跳出循环
-			//if (ret == _idSpanMap.end()) break;
-			auto ret = (Span*)_idSpanMap.get(nextId);
-			if (ret == nullptr) break;
-			
-			// 后面页的span正在被使用，无法合并页，break跳出循环
-			//Span* nextSpan = ret->second;
-			Span* nextSpan = ret;
-			if (nextSpan->_isUse == true) break;
-
-			// 合并出超过128页的span，没办法管理，无法合并页，break跳出循环
-			if (nextSpan->_nPages + span->_nPages > N_PAGES - 1) break;
-
-			// 开始向后合并
-			span->_nPages += nextSpan->_nPages;
-
-			_spanListBucket[nextSpan->_nPages].Erase(nextSpan); // 将将nextSpan从自由链表中解下来
-			_spanPool.Delete(nextSpan);
+			std::lock_guard<std::mutex> lock(heap.GetMutex());
+			heap.ReturnReleasedSpans(released);
 		}
 
-		// 将合并完的span挂入_spanListBucket[span->_nPages]中
-		_spanListBucket[span->_nPages].PushFront(span);
-		span->_isUse = false; // 将状态置为未被使用，使得其他的span可以对该span进行合并
+		return releasedPages;
+	}
 
-		// 将span的首尾页号和span的映射存入_idSpanMap中
-		/*_idSpanMap[span->_pageId] = span;
-		_idSpanMap[span->_pageId + span->_nPages - 1] = span;*/
-		_idSpanMap.set(span->_pageId, span);
-		_idSpanMap.set(span->_pageId + span->_nPages - 1, span);
+	// node节点的分片中当前线程所在CPU对应的那个
+	size_t ShardOf(size_t node)
+	{
+		return (node % _nNodes) * _shardsPerNode + NumaTopology::CurrentCpu() % _shardsPerNode;
 	}
 
 private:
-	SpanList _spanListBucket[N_PAGES];             // 自由链表桶
-	ObjectPool<Span> _spanPool;                    // span对象的定长内存池
-	std::mutex _pageMtx;						   // page cache的整体锁
-	//std::unordered_map<PAGE_ID, Span*> _idSpanMap; // 页号和span对象的映射关系
-	TCMalloc_PageMap1<32 - PAGE_SHIFT> _idSpanMap;
+	PageHeap _heaps[PAGE_HEAP_SHARDS]; // page cache的各个分片
+	SpanMap _idSpanMap;                // 页号和span对象的映射关系，所有分片共享
+	std::mutex _mapMtx;                // 保护_idSpanMap的Ensure
+	size_t _nNodes = 1;                // 分到分片的节点数，节点比分片多时多出来的节点和前面的节点共用分片
+	size_t _shardsPerNode = PAGE_HEAP_SHARDS; // 每个节点的分片数
 
 private:
-	PageCache() {}
+	PageCache()
+	{
+		_nNodes = std::min(NumaTopology::GetInstance()->NumNodes(), PAGE_HEAP_SHARDS);
+		_shardsPerNode = PAGE_HEAP_SHARDS / _nNodes;
+		for (size_t i = 0; i < PAGE_HEAP_SHARDS; ++i)
+		{
+			_heaps[i].Init(i, std::min(i / _shardsPerNode, _nNodes - 1), &_idSpanMap, &_mapMtx);
+		}
+	}
 
 	PageCache(const PageCache&) = delete;
-
-	static PageCache _singleInstance;
-};
-PageCache PageCache::_singleInstance;
\ No newline at end of file
+};
\ No newline at end of file
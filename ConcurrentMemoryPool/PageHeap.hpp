@@ -0,0 +1,659 @@
+#pragma once
+
+#include "Common.hpp"
+#include "ObjectPool.hpp"
+#include "PageMap.hpp"
+#include "Numa.hpp"
+
+static const uint64_t DEFAULT_RELEASE_INTERVAL_MS = 1000; // 空闲超过1秒的span会被归还给操作系统
+static const size_t BUCKET_BITMAP_WORDS = (N_PAGES + 63) / 64; // 自由链表桶非空位图的字数
+
+// 页号到span对象的映射
+#if defined(_WIN64) || defined(__x86_64__) || defined(__aarch64__)
+typedef TCMalloc_PageMap3<48 - PAGE_SHIFT> SpanMap; // 64位下48位虚拟地址，使用按需分配的三层基数树
+#else
+typedef TCMalloc_PageMap1<32 - PAGE_SHIFT> SpanMap;
+#endif
+
+// span对象的定长内存池，所有分片共用，申请和释放span对象不依赖分片的锁
+// 同PageCache，第一次使用时构造，永不析构；inline函数中的静态变量在所有编译单元中只有一份
+inline ConcurrentObjectPool<Span>* SpanPool()
+{
+	alignas(ConcurrentObjectPool<Span>) static char storage[sizeof(ConcurrentObjectPool<Span>)];
+	static ConcurrentObjectPool<Span>* pool = new(storage)ConcurrentObjectPool<Span>;
+	return pool;
+}
+
+// 一次GetSpan最多新建的span对象数：向系统申请的内存按128页切成的span，再加上切分出来的一个span
+static const size_t SPAN_RESERVE_SIZE = SYSTEM_ALLOC_PAGES / (N_PAGES - 1) + 1;
+
+// 调用方在加分片锁之前从SpanPool取出的span对象，PageHeap在锁内只从这里取，不在锁内向对象池申请
+// 要在分片锁之前定义：没用完的span对象在析构时还给SpanPool，此时分片锁已经释放
+// 向系统申请内存失败时可能取不满，调用方检查Filled()，取不满时不加锁直接返回失败
+class SpanReserve
+{
+public:
+	explicit SpanReserve(size_t n)
+	{
+		assert(n <= SPAN_RESERVE_SIZE + 2);
+		while (_count < n)
+		{
+			Span* span = SpanPool()->TryNew();
+			if (span == nullptr) break;
+
+			_spans[_count++] = span;
+		}
+		_filled = _count == n;
+	}
+
+	~SpanReserve()
+	{
+		while (_count > 0)
+		{
+			SpanPool()->Delete(_spans[--_count]);
+		}
+	}
+
+	Span* Take()
+	{
+		assert(_count > 0);
+		return _spans[--_count];
+	}
+
+	bool Filled() { return _filled; }
+
+	SpanReserve(const SpanReserve&) = delete;
+
+private:
+	Span* _spans[SPAN_RESERVE_SIZE + 2]; // 对齐申请另外需要前后切下来的两个span
+	size_t _count = 0;
+	bool _filled = false;
+};
+
+// page cache的一个分片：有自己的锁和自由链表桶，管理自己向操作系统申请的页
+// 每个分片另有一份只记录自己的span首尾页的映射，合并相邻span时只在这份映射里查找，
+// 所以相邻的页即使属于别的分片也不会被读到，合并永远不会跨分片：分片的页来自它自己向系统申请的映射，
+// 每段映射正好是一个最大的span（128页，或2个128页），分片内的合并已经能把一段映射拼回完整的span，
+// 跨分片合并只能拼出横跨两段映射的span，还要同时持有两个分片的锁，所以不做；
+// 需要新建span对象的函数从调用方加锁前准备好的SpanReserve中取，锁内不向对象池申请；
+// 全局映射由所有分片共享，供MapObjToSpan无锁查找，分片只写自己的页，Ensure由全局映射的锁保护
+// 每个分片属于一个NUMA节点，新向系统申请的内存都绑定到这个节点
+// 除Init外的函数都要求调用方持有该分片的锁；持有锁时不能抛异常（替换了malloc后申请异常对象会重入这把锁），
+// 向系统申请内存失败时返回nullptr，由调用方释放锁之后再处理
+class PageHeap
+{
+public:
+	void Init(size_t shard, size_t node, SpanMap* globalMap, std::mutex* globalMapMtx)
+	{
+		_shard = shard;
+		_node = node;
+		_globalMap = globalMap;
+		_globalMapMtx = globalMapMtx;
+	}
+
+	std::mutex& GetMutex() { return _pageMtx; }
+
+	// 获取一个nPages页的Span对象，返回的span已经置为使用状态，向系统申请内存失败时返回nullptr
+	// reserve中至少要有SpanReserveSize(nPages)个span对象
+	Span* GetSpan(size_t nPages, SpanReserve& reserve)
+	{
+		assert(nPages > 0);
+
+		// 申请的页数大于128页
+		if (nPages > N_PAGES - 1)
+		{
+			// 先在缓存的大块空闲span中最佳适配，多出来的页不超过1/8时直接使用，不切分
+			// （大块span是单独向系统申请的一段映射，切开后无法整段归还）
+			Span* cached = _largeSpans.LowerBound(nPages);
+			if (cached != nullptr && cached->_nPages - nPages <= (nPages >> 3))
+			{
+				_largeSpans.Erase(cached);
+				MapInUseSpan(cached);
+				cached->_isUse = true;
+
+				return cached;
+			}
+
+			// 直接向系统申请内存空间
+			void* ptr = SystemAlloc(nPages);
+			if (ptr == nullptr) return nullptr;
+			if (!EnsureMap((PAGE_ID)ptr >> PAGE_SHIFT, nPages))
+			{
+				SystemFree(ptr, nPages);
+				return nullptr;
+			}
+
+			NumaTopology::GetInstance()->BindToNode(ptr, nPages << PAGE_SHIFT, _node);
+			_systemPages += nPages;
+			Span* span = NewSpanObject(reserve);
+			span->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
+			span->_nPages = nPages;
+			span->_mapStart = true;
+
+			MapInUseSpan(span);
+			span->_isUse = true;
+
+			return span;
+		}
+
+		// 先检查第nPages个SpanList中有没有span
+		if (!_spanListBucket[nPages].Empty())
+		{
+			Span* nPagesSpan = _spanListBucket[nPages].Begin();
+			EraseSpan(nPagesSpan);
+			CommitSpan(nPagesSpan);
+
+			// 建立页号和span的映射关系，方便central cache回收小块内存时查找对应的span对象
+			MapInUseSpan(nPagesSpan);
+			nPagesSpan->_isUse = true;
+
+			return nPagesSpan;
+		}
+
+		// 执行到这说明，_spanListBucket[nPages]中没有span，则通过位图找到后面第一个非空的SpanList，将其中大的span切割
+		// 将这个n页的span切割成一个nPages的span和一个n-nPages的span
+		// nPages的span返回给central cache，n-nPages的span挂到_spanListBucket[n - nPages]中
+		size_t i = FindNonEmptyBucket(nPages + 1);
+		if (i < N_PAGES)
+		{
+			Span* bigSpan = _spanListBucket[i].Begin(); // 将_spanListBucket[i]中的大块的span拿出来
+			EraseSpan(bigSpan);
+			Span* nPagesSpan = NewSpanObject(reserve);
+
+			// 在大的span的头部切割一个nPages页的span
+			nPagesSpan->_pageId = bigSpan->_pageId;
+			nPagesSpan->_nPages = nPages;
+			nPagesSpan->_isReleased = bigSpan->_isReleased;
+			nPagesSpan->_mapStart = bigSpan->_mapStart;
+
+			// 更新完后的bigSpan就是注释中的n-nPages的span，要挂到_spanListBucket[n - nPages]中
+			bigSpan->_mapStart = false;
+			bigSpan->_pageId += nPages;
+			bigSpan->_nPages -= nPages;
+
+			// 将bigSpan挂到_spanListBucket[n - nPages]中
+			PushSpan(bigSpan);
+
+			// 存储bigSpan的首尾页号跟bigSpan的映射，方便page cache回收内存时进行的合并查找
+			MapFreeSpan(bigSpan);
+
+			// 建立页号和span的映射关系，方便central cache回收小块内存时查找对应的span对象
+			MapInUseSpan(nPagesSpan);
+			nPagesSpan->_isUse = true;
+
+			CommitSpan(nPagesSpan);
+			return nPagesSpan;
+		}
+
+		// 代码运行到这说明，_spanListBucket[nPages]之后一直到_spanListBucket[128]都没有大块的span了
+		// 此时需要向操作系统申请SYSTEM_ALLOC_PAGES页的内存（开启大页时为一个2MB大页），按128页切成span
+		void* ptr = SystemAlloc(SYSTEM_ALLOC_PAGES);
+		if (ptr == nullptr) return nullptr;
+		if (!EnsureMap((PAGE_ID)ptr >> PAGE_SHIFT, SYSTEM_ALLOC_PAGES)) // 为新内存的页号准备好基数树节点
+		{
+			SystemFree(ptr, SYSTEM_ALLOC_PAGES);
+			return nullptr;
+		}
+
+		NumaTopology::GetInstance()->BindToNode(ptr, SYSTEM_ALLOC_PAGES << PAGE_SHIFT, _node);
+		_systemPages += SYSTEM_ALLOC_PAGES;
+		for (size_t offset = 0; offset < SYSTEM_ALLOC_PAGES; offset += N_PAGES - 1)
+		{
+			Span* newSpan = NewSpanObject(reserve);
+			newSpan->_pageId = ((PAGE_ID)ptr >> PAGE_SHIFT) + offset;
+			newSpan->_nPages = N_PAGES - 1;
+			newSpan->_mapStart = offset == 0;
+			newSpan->_freeTime = NowMs();
+
+			// 将newSpan挂到128页的_spanListBucket[128]中
+			PushSpan(newSpan);
+			MapFreeSpan(newSpan);
+		}
+
+		// 递归调一次，将刚刚申请的128页的span切割成需要的nPages页的span
+		return GetSpan(nPages, reserve);
+	}
+
+	// 获取一个nPages页、起始页号是alignPages整数倍的span
+	// 多申请alignPages-1页，再把对齐位置前后多出来的页切掉：page cache中切出的span归还给page cache，
+	// 直接向系统申请的span把多余的页解除映射
+	// page cache中的span不跨过映射的边界（见_mapStart），切下的前后两段和原来的span属于同一次映射，
+	// 归还时同样不会和别的映射的页合并；直接向系统申请的span解除首尾的映射后，剩下的中间部分仍是一段完整的映射
+	// reserve中至少要有SpanReserveSize(nPages + alignPages - 1) + 2个span对象
+	Span* GetAlignedSpan(size_t nPages, size_t alignPages, SpanReserve& reserve)
+	{
+		if (alignPages <= 1) return GetSpan(nPages, reserve);
+
+		size_t total = nPages + alignPages - 1;
+		Span* span = GetSpan(total, reserve);
+		if (span == nullptr) return nullptr;
+
+		PAGE_ID alignedId = (span->_pageId + alignPages - 1) & ~(PAGE_ID)(alignPages - 1);
+		size_t head = alignedId - span->_pageId;
+		size_t tail = span->_nPages - head - nPages; // 复用缓存的大块span时可能比total多几页
+
+		if (total > N_PAGES - 1)
+		{
+			UnmapSpan(span);
+			if (head > 0)
+			{
+				SystemFree((void*)(span->_pageId << PAGE_SHIFT), head);
+			}
+			if (tail > 0)
+			{
+				SystemFree((void*)((alignedId + nPages) << PAGE_SHIFT), tail);
+			}
+			_systemPages -= head + tail;
+
+			span->_pageId = alignedId;
+			span->_nPages = nPages;
+			MapInUseSpan(span);
+
+			return span;
+		}
+
+		bool mapStart = span->_mapStart;
+		span->_pageId = alignedId;
+		span->_nPages = nPages;
+		span->_mapStart = mapStart && head == 0;
+		MapInUseSpan(span);
+
+		// 前后切下来的部分先当作正在使用的span，再按正常的释放流程归还并合并
+		if (head > 0)
+		{
+			Span* headSpan = NewSpanObject(reserve);
+			headSpan->_pageId = alignedId - head;
+			headSpan->_nPages = head;
+			headSpan->_mapStart = mapStart;
+			headSpan->_isUse = true;
+			ReleaseSpanToPageCache(headSpan);
+		}
+		if (tail > 0)
+		{
+			Span* tailSpan = NewSpanObject(reserve);
+			tailSpan->_pageId = alignedId + nPages;
+			tailSpan->_nPages = tail;
+			tailSpan->_isUse = true;
+			ReleaseSpanToPageCache(tailSpan);
+		}
+
+		return span;
+	}
+
+	// 把正在使用的大块内存span原地扩大到nPages页，成功返回true
+	// 不超过128页的span吞并后面相邻的、同一次映射中的空闲span（不够用时切下需要的部分），span的起始页号不变；
+	// 超过128页的span是直接向系统申请的，通过mremap扩展，原地放不下时由内核移动到新地址，span的起始页号会改变
+	bool GrowSpan(Span* span, size_t nPages)
+	{
+		assert(span->_isUse && nPages > span->_nPages);
+
+		if (span->_nPages > N_PAGES - 1)
+		{
+			void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
+
+			// 先尝试在原地址后面直接扩展
+			if (EnsureMap(span->_pageId, nPages) && SystemRemap(ptr, span->_nPages, nPages, nullptr))
+			{
+				UnmapSpan(span);
+			}
+			else
+			{
+#ifdef __linux__
+				// 申请一段对齐的新地址，再把原来的映射整个移动过去
+				void* target = SystemAlloc(nPages);
+				if (target == nullptr) return false;
+
+				if (!EnsureMap((PAGE_ID)target >> PAGE_SHIFT, nPages)
+					|| !SystemRemap(ptr, span->_nPages, nPages, target))
+				{
+					SystemFree(target, nPages);
+					return false;
+				}
+
+				// 移动过来的映射替换了target上原来的映射，在移动之后再绑定节点，新增的页才会从这个节点分配
+				NumaTopology::GetInstance()->BindToNode(target, nPages << PAGE_SHIFT, _node);
+
+				UnmapSpan(span);
+				span->_pageId = (PAGE_ID)target >> PAGE_SHIFT;
+#else
+				return false;
+#endif
+			}
+
+			_systemPages += nPages - span->_nPages;
+			span->_nPages = nPages;
+			MapInUseSpan(span);
+
+			return true;
+		}
+
+		// page cache管理的span合并后也不能超过128页
+		if (nPages > N_PAGES - 1) return false;
+
+		PAGE_ID nextId = span->_pageId + span->_nPages;
+		Span* nextSpan = (Span*)_idSpanMap.get(nextId);
+		if (nextSpan == nullptr || nextSpan->_isUse || nextSpan->_pageId != nextId || nextSpan->_mapStart) return false;
+
+		size_t need = nPages - span->_nPages;
+		if (nextSpan->_nPages < need) return false;
+
+		CommitSpan(nextSpan);
+		EraseSpan(nextSpan);
+
+		if (nextSpan->_nPages == need)
+		{
+			SpanPool()->Delete(nextSpan);
+		}
+		else
+		{
+			// 切下nextSpan头部的need页，剩下的部分重新挂回自由链表桶
+			nextSpan->_pageId += need;
+			nextSpan->_nPages -= need;
+			PushSpan(nextSpan);
+			MapFreeSpan(nextSpan);
+		}
+
+		// 吞并的页同样建立到span的映射
+		span->_nPages = nPages;
+		MapInUseSpan(span);
+
+		return true;
+	}
+
+	// 归还空闲的span到page cache，并合并相邻的span
+	void ReleaseSpanToPageCache(Span* span)
+	{
+		// 大于128页的span放入按页数有序的树中，留给之后的大块内存申请复用，空闲超过间隔后再还给系统
+		if (span->_nPages > N_PAGES - 1)
+		{
+			UnmapSpan(span); // 清除映射，避免相邻span合并时查到已释放的span对象
+			span->_isUse = false;
+			span->_freeTime = NowMs();
+			_largeSpans.Insert(span);
+			return;
+		}
+
+		// 对span前的页尝试进行合并
+		// 相邻的两次映射在地址上可能恰好连续，合并不跨过映射的边界：Windows上提交、取消提交不能跨过
+		// 两次VirtualAlloc的区域，各段映射的NUMA绑定和大页属性也可能不同
+		while (!span->_mapStart)
+		{
+			PAGE_ID prevId = span->_pageId - 1;
+			auto ret = (Span*)_idSpanMap.get(prevId); // 分片内的映射里查不到说明前面的页不属于这个分片
+			if (ret == nullptr) break;
+
+			// 前面页的span正在被使用，无法合并页，break跳出循环
+			Span* prevSpan = ret;
+			if (prevSpan->_isUse == true) break;
+
+			// 映射已经过时（前面的页被别的span吞并过），无法合并页，break跳出循环
+			if (prevSpan->_pageId + prevSpan->_nPages != span->_pageId) break;
+
+			// 合并出超过128页的span，没办法管理，无法合并页，break跳出循环
+			if (prevSpan->_nPages + span->_nPages > N_PAGES - 1) break;
+
+			// 开始向前合并，合并后的span按已提交处理，所以先重新提交已归还的页
+			CommitSpan(prevSpan);
+			span->_pageId = prevSpan->_pageId;
+			span->_nPages += prevSpan->_nPages;
+			span->_mapStart = prevSpan->_mapStart;
+
+			EraseSpan(prevSpan); // 将prevSpan从自由链表中解下来
+			SpanPool()->Delete(prevSpan);
+		}
+
+		// 对span后的页尝试进行合并
+		while (true)
+		{
+			PAGE_ID nextId = span->_pageId + span->_nPages;
+			auto ret = (Span*)_idSpanMap.get(nextId);
+			if (ret == nullptr) break;
+
+			// 后面页的span正在被使用，无法合并页，break跳出循环
+			Span* nextSpan = ret;
+			if (nextSpan->_isUse == true) break;
+
+			// 映射已经过时，无法合并页，break跳出循环
+			if (nextSpan->_pageId != nextId) break;
+
+			// 后面的span是另一次映射的开始，不跨过映射的边界合并
+			if (nextSpan->_mapStart) break;
+
+			// 合并出超过128页的span，没办法管理，无法合并页，break跳出循环
+			if (nextSpan->_nPages + span->_nPages > N_PAGES - 1) break;
+
+			// 开始向后合并
+			CommitSpan(nextSpan);
+			span->_nPages += nextSpan->_nPages;
+
+			EraseSpan(nextSpan); // 将nextSpan从自由链表中解下来
+			SpanPool()->Delete(nextSpan);
+		}
+
+		// 将合并完的span挂入_spanListBucket[span->_nPages]中
+		PushSpan(span);
+		span->_isUse = false; // 将状态置为未被使用，使得其他的span可以对该span进行合并
+
+		// 将span的首尾页号和span的映射存入分片内的映射中
+		MapFreeSpan(span);
+
+		span->_freeTime = NowMs();
+	}
+
+	// 取出空闲时间达到idleMs、物理页还没有归还的span，用_next串成链表返回，idleMs为0时取出所有空闲span
+	// 归还物理页的系统调用很慢，由调用方释放分片锁之后再执行：
+	// 不超过128页的span从自由链表桶中摘下并暂时标记为使用中，其他线程不会分配它、也不会和它合并，
+	// 归还物理页后通过ReturnReleasedSpans放回；缓存的大于128页的span整段取出，由调用方还给系统
+	Span* TakeIdleSpans(uint64_t idleMs)
+	{
+		uint64_t now = NowMs();
+		Span* spans = nullptr;
+
+		for (size_t i = FindNonEmptyBucket(1); i < N_PAGES; i = FindNonEmptyBucket(i + 1))
+		{
+			for (Span* it = _spanListBucket[i].Begin(); it != _spanListBucket[i].End();)
+			{
+				Span* next = it->_next;
+				if (!it->_isReleased && now - it->_freeTime >= idleMs)
+				{
+					EraseSpan(it);
+					it->_isUse = true;
+					it->_next = spans;
+					spans = it;
+				}
+				it = next;
+			}
+		}
+
+		// 遍历时不能修改树，先用_freeList把要归还的大块span串起来
+		Span* expired = nullptr;
+		_largeSpans.ForEach([&](Span* it) {
+			if (now - it->_freeTime < idleMs) return;
+
+			it->_freeList = expired;
+			expired = it;
+		});
+		while (expired)
+		{
+			Span* next = (Span*)expired->_freeList;
+			expired->_freeList = nullptr;
+
+			_largeSpans.Erase(expired);
+			_systemPages -= expired->_nPages;
+			expired->_next = spans;
+			spans = expired;
+
+			expired = next;
+		}
+		_lastReleaseTime = now;
+
+		return spans;
+	}
+
+	// 把TakeIdleSpans取出、物理页已经归还的span放回自由链表桶
+	// 期间释放的相邻span没有和它们合并，放回时也不合并，之后相邻的span再释放时照常合并
+	void ReturnReleasedSpans(Span* spans)
+	{
+		while (spans)
+		{
+			Span* next = spans->_next;
+			assert(spans->_nPages <= N_PAGES - 1);
+
+			spans->_isUse = false;
+			spans->_isReleased = true;
+			PushSpan(spans);
+			MapFreeSpan(spans);
+
+			spans = next;
+		}
+	}
+
+	// 摊还式回收：距离上次回收超过间隔时返回true，idleMs为回收的空闲时长
+	// 同时记下回收时间，其他线程不会再重复回收，由调用方释放分片锁之后执行回收
+	bool ReleaseDue(uint64_t& idleMs)
+	{
+		uint64_t now = NowMs();
+		if (_releaseInterval == 0 || now - _lastReleaseTime < _releaseInterval) return false;
+
+		_lastReleaseTime = now;
+		idleMs = _releaseInterval;
+		return true;
+	}
+
+	// 把这个分片的统计信息累加到stats中
+	void GetStats(AllocatorStats& stats)
+	{
+		stats._systemPages += _systemPages;
+		for (size_t i = FindNonEmptyBucket(1); i < N_PAGES; i = FindNonEmptyBucket(i + 1))
+		{
+			for (Span* it = _spanListBucket[i].Begin(); it != _spanListBucket[i].End(); it = it->_next)
+			{
+				++stats._pageCacheSpans;
+				stats._pageCachePages += it->_nPages;
+				if (it->_isReleased) stats._pageCacheReleasedPages += it->_nPages;
+			}
+		}
+
+		_largeSpans.ForEach([&](Span* it) {
+			++stats._pageCacheSpans;
+			stats._pageCachePages += it->_nPages;
+		});
+	}
+
+	// GetSpan(nPages)最多新建的span对象数：大块内存只新建一个，否则可能要向系统申请内存再切分
+	static size_t SpanReserveSize(size_t nPages)
+	{
+		return nPages > N_PAGES - 1 ? 1 : SPAN_RESERVE_SIZE;
+	}
+
+	// 设置空闲span归还给操作系统的时间间隔（毫秒），0表示关闭摊还式回收
+	void SetReleaseInterval(uint64_t ms) { _releaseInterval = ms; }
+
+	uint64_t GetReleaseInterval() { return _releaseInterval; }
+
+private:
+	// 把空闲span挂到对应页数的自由链表桶中，并在位图中标记该桶非空
+	void PushSpan(Span* span)
+	{
+		_spanListBucket[span->_nPages].PushFront(span);
+		_bucketBitmap[span->_nPages >> 6] |= (uint64_t)1 << (span->_nPages & 63);
+	}
+
+	// 把空闲span从自由链表桶中解下来，桶空了就清除位图中的标记
+	void EraseSpan(Span* span)
+	{
+		_spanListBucket[span->_nPages].Erase(span);
+		if (_spanListBucket[span->_nPages].Empty())
+		{
+			_bucketBitmap[span->_nPages >> 6] &= ~((uint64_t)1 << (span->_nPages & 63));
+		}
+	}
+
+	// 第一个下标不小于from的非空自由链表桶，没有时返回N_PAGES
+	size_t FindNonEmptyBucket(size_t from)
+	{
+		for (size_t word = from >> 6; word < BUCKET_BITMAP_WORDS; ++word)
+		{
+			uint64_t bits = _bucketBitmap[word];
+			if (word == from >> 6) bits &= ~(uint64_t)0 << (from & 63);
+			if (bits != 0) return std::min((word << 6) + CountTrailingZeros(bits), N_PAGES);
+		}
+
+		return N_PAGES;
+	}
+
+	// 从加锁前准备好的span对象中取一个，并记录它属于这个分片，归还时据此找回分片
+	Span* NewSpanObject(SpanReserve& reserve)
+	{
+		Span* span = reserve.Take();
+		span->_shard = _shard;
+		return span;
+	}
+
+	// 为新内存的页号在分片内的映射和全局映射中准备好基数树节点
+	bool EnsureMap(PAGE_ID start, size_t n)
+	{
+		if (!_idSpanMap.Ensure(start, n)) return false;
+
+		std::lock_guard<std::mutex> lock(*_globalMapMtx);
+		return _globalMap->Ensure(start, n);
+	}
+
+	// 正在使用的span：全局映射中不超过128页的span每一页都要映射，方便central cache回收小块内存时查找，
+	// 直接向系统申请的大块span只映射首页；分片内的映射只记录首尾页，供相邻span合并时判断
+	void MapInUseSpan(Span* span)
+	{
+		if (span->_nPages > N_PAGES - 1)
+		{
+			_globalMap->set(span->_pageId, span);
+		}
+		else
+		{
+			for (PAGE_ID i = 0; i < span->_nPages; ++i)
+			{
+				_globalMap->set(span->_pageId + i, span);
+			}
+		}
+
+		MapFreeSpan(span);
+	}
+
+	// 空闲的span只需要在分片内的映射中记录首尾页
+	void MapFreeSpan(Span* span)
+	{
+		_idSpanMap.set(span->_pageId, span);
+		_idSpanMap.set(span->_pageId + span->_nPages - 1, span);
+	}
+
+	// 清除直接向系统申请的span的映射，它的地址空间之后可能被别的分片或别的程序复用
+	void UnmapSpan(Span* span)
+	{
+		_globalMap->set(span->_pageId, nullptr);
+		_idSpanMap.set(span->_pageId, nullptr);
+		_idSpanMap.set(span->_pageId + span->_nPages - 1, nullptr);
+	}
+
+	// 把span交出去之前，确保之前归还给操作系统的物理页重新可用
+	void CommitSpan(Span* span)
+	{
+		if (span->_isReleased)
+		{
+			SystemCommit((void*)(span->_pageId << PAGE_SHIFT), span->_nPages);
+			span->_isReleased = false;
+		}
+	}
+
+private:
+	SpanList _spanListBucket[N_PAGES];             // 自由链表桶
+	uint64_t _bucketBitmap[BUCKET_BITMAP_WORDS] = {}; // 第i位表示_spanListBucket[i]非空
+	SpanTree _largeSpans;                          // 大于128页的空闲span，按页数有序
+	std::mutex _pageMtx;						   // 分片的锁
+	size_t _shard = 0;                             // 分片编号
+	size_t _node = 0;                              // 分片所属的NUMA节点
+	uint64_t _releaseInterval = DEFAULT_RELEASE_INTERVAL_MS; // 空闲span归还给操作系统的间隔
+	uint64_t _lastReleaseTime = 0;                 // 上一次回收空闲span的时间
+	size_t _systemPages = 0;                       // 从操作系统申请且尚未释放的页数
+	SpanMap _idSpanMap;                            // 分片内span首尾页的映射，只用于合并
+	SpanMap* _globalMap = nullptr;                 // 所有分片共享的页号到span的映射
+	std::mutex* _globalMapMtx = nullptr;           // 保护全局映射的Ensure
+};
\ No newline at end of file
@@ -36,6 +36,12 @@ public:
 		array_[k] = v;
 	}
 
+	// 平铺数组在构造时已经覆盖了全部页号
+	bool Ensure(Number start, size_t n)
+	{
+		return ((start + n - 1) >> BITS) == 0;
+	}
+
 private:
 	static const int LENGTH = 1 << BITS;
 	void** array_;
@@ -70,7 +76,7 @@ public:
 		const Number i1 = k >> LEAF_BITS;
 		const Number i2 = k & (LEAF_LENGTH - 1);
 
-		ASSERT(i1 < ROOT_LENGTH);
+		assert(i1 < ROOT_LENGTH);
 		root_[i1]->values[i2] = v;
 	}
 
@@ -87,7 +93,7 @@ public:
 			if (root_[i1] == NULL) {
 				static ObjectPool<Leaf> leafPool;
 				Leaf* leaf = (Leaf*)leafPool.New();
-				
+				if (leaf == NULL) return false;
 				memset(leaf, 0, sizeof(*leaf));
 				root_[i1] = leaf;
 			}
@@ -122,15 +128,16 @@ private:
 };
 
 // Three-level radix tree
+// 64位地址空间下使用，内部节点和叶子节点都由ObjectPool按需分配，不需要预先保留整张平铺数组
+// set()和Ensure()由调用方加锁保护；节点一经创建就不会释放，所以get()不需要加锁
 template <int BITS>
 class TCMalloc_PageMap3
 {
 public:
 	typedef uintptr_t Number;
 
-	explicit TCMalloc_PageMap3(void* (*allocator)(size_t))
+	explicit TCMalloc_PageMap3()
 	{
-		allocator_ = allocator;
 		root_ = NewNode();
 	}
 
@@ -145,9 +152,10 @@ public:
 		return reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->values[i3];
 	}
 
+	// REQUIRES "k" has been ensured before.
 	void set(Number k, void* v)
 	{
-		ASSERT(k >> BITS == 0);
+		assert(k >> BITS == 0);
 
 		const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
 		const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
@@ -176,7 +184,7 @@ public:
 
 			// Make leaf node if necessary
 			if (root_->ptrs[i1]->ptrs[i2] == NULL) {
-				Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
+				Leaf* leaf = leafPool_.New();
 				if (leaf == NULL) return false;
 				memset(leaf, 0, sizeof(*leaf));
 				root_->ptrs[i1]->ptrs[i2] = reinterpret_cast<Node*>(leaf);
@@ -213,12 +221,13 @@ private:
 		void* values[LEAF_LENGTH];
 	};
 
-	Node* root_;                 // Root of radix tree
-	void* (*allocator_)(size_t); // Memory allocator
+	Node* root_;                // Root of radix tree
+	ObjectPool<Node> nodePool_; // 内部节点的定长内存池
+	ObjectPool<Leaf> leafPool_; // 叶子节点的定长内存池
 
 	Node* NewNode()
 	{
-		Node* result = reinterpret_cast<Node*>((*allocator_)(sizeof(Node)));
+		Node* result = nodePool_.New();
 		if (result != NULL) memset(result, 0, sizeof(*result));
 
 		return result;
@@ -2,11 +2,75 @@
 
 #include "Common.hpp"
 #include "CentralCache.hpp"
+#include "ObjectPool.hpp"
 
+static const size_t DEFAULT_THREAD_CACHE_BUDGET = 32 * 1024 * 1024; // 所有thread cache合计缓存的字节数上限，默认32MB
+static const size_t MIN_THREAD_CACHE_BYTES = 2 * MAX_BYTES;          // 单个thread cache的容量下限
+static const size_t THREAD_CACHE_STEAL_BYTES = 64 * 1024;            // 每次从全局预算或其他thread cache挪用的容量
+static const size_t MAX_LIST_OVERAGES = 3;                           // 自由链表连续过长几次后缩小它的MaxSize
+
+#ifdef CMP_REMOTE_FREE
+// 定义CMP_REMOTE_FREE后，每个span记录最近从它取走内存块的thread cache（owner），其他线程释放这些内存块时
+// 不放入自己的缓存，而是攒成一批放入owner的远程释放栈，owner下次从同一个桶申请时取走复用
+// 生产者线程申请、消费者线程释放的场景下，内存留在复用它的生产者线程中，不会单向堆积到消费者线程
+static const size_t REMOTE_BATCH_SIZE = 32;   // 释放别的thread cache的内存块时，攒够多少个再交给它
+static const uintptr_t REMOTE_CLOSED = 1;     // 远程释放栈已关闭（owner线程已退出）
+
+// 这个线程释放的、属于同一个owner的一批内存块
+struct RemoteBatch
+{
+    void* _owner = nullptr; // 这批内存块要交给的thread cache
+    void* _head = nullptr;
+    void* _tail = nullptr;
+    std::atomic<size_t> _count{ 0 }; // 同FreeList的计数，只有本线程修改，GetStats会在其他线程读取
+};
+#endif
+
+// 所有thread cache共享一个总的字节预算：每个thread cache有自己的容量上限_maxSize，各线程的_maxSize加上
+// 未分配的预算等于总预算。缓存超过上限时先归还各个桶中一直没用到的内存块，再从未分配的预算或其他
+// thread cache（轮流挑选）挪用一部分没有用到的容量，忙的线程容量逐渐变大，闲的线程逐渐让出容量
+// 每个thread cache缓存的字节数在它自己释放内存后不超过_maxSize，挪用也不会让被挪用的超过，缓存的总字节数不超过总预算
 class ThreadCache
 {
 public:
-    // 从thread cache中申请内存
+    // 创建和销毁时登记到全局的thread cache链表中，获取统计信息时遍历，同时领取和交还容量
+    // 创建时记下所在的NUMA节点，之后都从这个节点的central cache申请和归还内存
+    ThreadCache()
+        :_node(NumaTopology::GetInstance()->CurrentNode())
+    {
+        std::lock_guard<std::mutex> lock(_listMtx);
+        _nextCache = _listHead;
+        if (_listHead) _listHead->_prevCache = this;
+        _listHead = this;
+
+        // 预算不够时也给下限容量，多出来的部分由其他线程缩小容量时还回来
+        _maxSize.store(MIN_THREAD_CACHE_BYTES, std::memory_order_relaxed);
+        _unclaimedBudget -= (ptrdiff_t)MIN_THREAD_CACHE_BYTES;
+
+#ifdef CMP_REMOTE_FREE
+        // 其他线程可能还拿着上一个使用这块内存的thread cache的指针，远程释放栈用原子操作打开，不用成员初始化
+        // 计数先清零再打开，看到打开的栈的线程一定也看到清零后的计数
+        _remoteBytes.store(0, std::memory_order_relaxed);
+        for (size_t i = 0; i < N_FREELISTS; ++i)
+        {
+            _remoteObjs[i].store(0, std::memory_order_relaxed);
+            _remoteFrees[i].store(nullptr, std::memory_order_release);
+        }
+#endif
+    }
+
+    ~ThreadCache()
+    {
+        std::lock_guard<std::mutex> lock(_listMtx);
+        if (_prevCache) _prevCache->_nextCache = _nextCache;
+        else _listHead = _nextCache;
+        if (_nextCache) _nextCache->_prevCache = _prevCache;
+        if (_nextSteal == this) _nextSteal = _nextCache;
+
+        _unclaimedBudget += (ptrdiff_t)_maxSize.load(std::memory_order_relaxed);
+    }
+
+    // 从thread cache中申请内存，内存不足时返回nullptr
     void* Allocate(size_t size)
     {
         assert(size <= MAX_BYTES);
@@ -17,6 +81,7 @@ public:
         // 优先使用自由链表中管理的内存块
         if (!_freeListBucket[index].Empty())
         {
+            SubSize(alignSize);
             return _freeListBucket[index].Pop();
         }
         else
@@ -25,7 +90,7 @@ public:
         }
     }
 
-    // 将内存块归还给thread cache
+    // 将内存块归还给thread cache，size是对齐后的大小
     void Deallocate(void* ptr, size_t size)
     {
         assert(ptr);
@@ -34,19 +99,113 @@ public:
         // 计算对应的自由链表桶的下标，将归还的内存块头插到该下标的自由链表中
         size_t index = SizeClass::Index(size);
         _freeListBucket[index].Push(ptr);
+        AddSize(size);
 
         // 当链表长度大于等于一次批量申请的内存时就将freeList中的一段小内存块归还给central cache
         if (_freeListBucket[index].Size() >= _freeListBucket[index].MaxSize())
         {
             ListTooLong(_freeListBucket[index], size);
         }
+
+        // 缓存的总字节数超过了这个thread cache的容量上限
+        if (OverLimit())
+        {
+            Scavenge();
+        }
     }
 
-    // 从central cache中申请内存（获取thread cache对象）
+    // 一次申请n个size字节的内存块写入out[0, n)
+    // 自由链表中已有的内存块整段取出，不够时直接向central cache申请剩下的数量，不再逐个走Allocate
+    // 内存不足时已经取到的内存块放回自由链表，返回false
+    bool AllocateBatch(size_t size, size_t n, void** out)
+    {
+        assert(size <= MAX_BYTES);
+
+        size_t alignSize = SizeClass::RoundUp(size);
+        size_t index = SizeClass::Index(size);
+        FreeList& freeList = _freeListBucket[index];
+
+        size_t got = 0;
+        while (got < n)
+        {
+#ifdef CMP_REMOTE_FREE
+            if (freeList.Empty()) TakeRemoteFrees(index, alignSize, false);
+#endif
+            void* start = nullptr;
+            void* end = nullptr;
+            size_t k = 0;
+            if (!freeList.Empty())
+            {
+                k = std::min(freeList.Size(), n - got);
+                freeList.PopRange(start, end, k);
+                SubSize(k * alignSize);
+            }
+            else
+            {
+                // 每次最多申请一整批，可以直接从transfer cache中拿
+                freeList.AddFetchCount();
+                k = CentralCache::GetInstance(_node)->FetchRangeObj(start, end, std::min(n - got, SizeClass::NumMoveSize(alignSize)), alignSize);
+                if (k == 0)
+                {
+                    // 向central cache申请失败时，已经取到的内存块放回自由链表，不泄漏
+                    for (size_t i = 0; i < got; ++i)
+                    {
+                        freeList.Push(out[i]);
+                    }
+                    AddSize(got * alignSize);
+                    return false;
+                }
+#ifdef CMP_REMOTE_FREE
+                ClaimSpans(start, k);
+#endif
+            }
+
+            for (size_t i = 0; i < k; ++i)
+            {
+                out[got++] = start;
+                start = NextObj(start);
+            }
+        }
+        return true;
+    }
+
+    // 将[start, end]这n个对齐后大小为size的内存块整段归还给thread cache
+    void DeallocateRange(void* start, void* end, size_t n, size_t size)
+    {
+        assert(size <= MAX_BYTES);
+
+        size_t index = SizeClass::Index(size);
+        FreeList& freeList = _freeListBucket[index];
+        freeList.PushRange(start, end, n);
+        AddSize(n * size);
+
+        // 一次放入的内存块可能远超过MaxSize，循环归还直到链表不再过长
+        while (freeList.Size() >= freeList.MaxSize())
+        {
+            ListTooLong(freeList, size);
+        }
+
+        if (OverLimit())
+        {
+            Scavenge();
+        }
+    }
+
+    // 从central cache中申请内存（获取thread cache对象），内存不足时返回nullptr
     void* FetchFromCentralCache(size_t index, size_t size)
     {
+#ifdef CMP_REMOTE_FREE
+        // 先复用其他线程交还回来的内存块，没有时才向central cache申请
+        if (TakeRemoteFrees(index, size, false) > 0)
+        {
+            SubSize(size);
+            return _freeListBucket[index].Pop();
+        }
+#endif
+
         // 慢开始反馈调节算法，批量获取内存块
-        size_t batchNum = min(_freeListBucket[index].MaxSize(), SizeClass::NumMoveSize(size));
+        _freeListBucket[index].AddFetchCount();
+        size_t batchNum = std::min(_freeListBucket[index].MaxSize(), SizeClass::NumMoveSize(size));
         if (_freeListBucket[index].MaxSize() == batchNum)
         {
             _freeListBucket[index].MaxSize() += 1; // 慢增长
@@ -55,8 +214,11 @@ public:
         // 向central cache申请batchNum个内存块
         void* start = nullptr;
         void* end = nullptr;
-        size_t actualNum = CentralCache::GetInstance()->FetchRangeObj(start, end, batchNum, size);
-        assert(actualNum >= 1);
+        size_t actualNum = CentralCache::GetInstance(_node)->FetchRangeObj(start, end, batchNum, size);
+        if (actualNum == 0) return nullptr;
+#ifdef CMP_REMOTE_FREE
+        ClaimSpans(start, actualNum);
+#endif
         
         if (actualNum == 1)
         {
@@ -67,6 +229,7 @@ public:
         {
             // 将申请到的多个内存块插入自由链表桶下挂的自由链表中
             _freeListBucket[index].PushRange(NextObj(start), end, actualNum - 1);
+            AddSize((actualNum - 1) * size);
         }
 
         return start;
@@ -74,16 +237,476 @@ public:
 
     // 处理thread cache中过长的freeList
     void ListTooLong(FreeList& freeList, size_t size)
+    {
+        // 最多归还一整批，归还的内存块可以直接放入transfer cache给其他线程复用
+        size_t batchNum = SizeClass::NumMoveSize(size);
+        size_t n = std::min(freeList.MaxSize(), batchNum);
+        freeList.AddOverflowCount();
+
+        ReleaseToCentralCache(freeList, n, size);
+
+        // 慢增长超过一整批之后，链表还是连续过长，说明这个桶释放多于申请，缩小它的MaxSize
+        if (freeList.MaxSize() > batchNum && ++freeList.Overages() > MAX_LIST_OVERAGES)
+        {
+            freeList.MaxSize() = std::max(freeList.MaxSize() - batchNum, batchNum);
+            freeList.Overages() = 0;
+        }
+    }
+
+    // 缓存超过容量上限时调用：每个桶归还上次回收以来一直没用到的内存块（低水位）的一半，再调整容量上限
+    // 这个线程正在频繁使用缓存时低水位很低，归还得少，容量上限会从其他地方挪用变大
+    void Scavenge()
+    {
+#ifdef CMP_REMOTE_FREE
+        // 收回其他线程交还的内存块和自由链表中的一起回收，同时把自己攒的批交给owner
+        for (size_t i = 0; i < N_FREELISTS; ++i)
+        {
+            TakeRemoteFrees(i, SizeClass::IndexToSize(i), false);
+            FlushRemoteBatch(i, SizeClass::IndexToSize(i));
+        }
+#endif
+
+        for (size_t i = 0; i < N_FREELISTS; ++i)
+        {
+            FreeList& freeList = _freeListBucket[i];
+            size_t lowWater = freeList.LowWater();
+            if (lowWater > 0)
+            {
+                size_t size = SizeClass::IndexToSize(i);
+                ReleaseToCentralCache(freeList, lowWater > 1 ? lowWater / 2 : 1, size);
+
+                size_t batchNum = SizeClass::NumMoveSize(size);
+                if (freeList.MaxSize() > batchNum)
+                {
+                    freeList.MaxSize() = std::max(freeList.MaxSize() - batchNum, batchNum);
+                }
+            }
+            freeList.LowWater() = freeList.Size();
+        }
+
+        AdjustCacheLimit();
+
+        // 挪用不到容量时，每个桶直接归还一半，直到不超过上限
+        while (_size.load(std::memory_order_relaxed) > _maxSize.load(std::memory_order_relaxed))
+        {
+            for (size_t i = 0; i < N_FREELISTS; ++i)
+            {
+                FreeList& freeList = _freeListBucket[i];
+                if (freeList.Empty()) continue;
+
+                ReleaseToCentralCache(freeList, (freeList.Size() + 1) / 2, SizeClass::IndexToSize(i));
+                freeList.LowWater() = freeList.Size();
+            }
+        }
+    }
+
+    // 将所有自由链表桶中的内存块归还给central cache，线程退出时调用
+    void ReleaseAll()
+    {
+#ifdef CMP_REMOTE_FREE
+        // 关闭远程释放栈并收回其中的内存块，之后其他线程释放属于这个thread cache的内存块时直接归还给central cache
+        for (size_t i = 0; i < N_FREELISTS; ++i)
+        {
+            FlushRemoteBatch(i, SizeClass::IndexToSize(i));
+            TakeRemoteFrees(i, SizeClass::IndexToSize(i), true);
+        }
+#endif
+
+        for (size_t i = 0; i < N_FREELISTS; ++i)
+        {
+            FreeList& freeList = _freeListBucket[i];
+            if (freeList.Empty()) continue;
+
+            void* start = nullptr;
+            void* end = nullptr;
+            freeList.PopRange(start, end, freeList.Size());
+
+            // 同一个桶中的内存块大小相同，通过第一个内存块所在的span得到对齐后的大小
+            size_t size = PageCache::GetInstance()->MapObjToSpan(start)->_objSize;
+            CentralCache::GetInstance(_node)->ReleaseListToSpans(start, size);
+        }
+        _size.store(0, std::memory_order_relaxed);
+    }
+
+    // 汇总所有thread cache的统计信息，其他线程的计数不加锁读取，是近似值
+    static void GetStats(AllocatorStats& stats)
+    {
+        std::lock_guard<std::mutex> lock(_listMtx);
+
+        for (ThreadCache* tc = _listHead; tc != nullptr; tc = tc->_nextCache)
+        {
+            ++stats._threadCaches;
+            for (size_t i = 0; i < N_FREELISTS; ++i)
+            {
+                FreeList& freeList = tc->_freeListBucket[i];
+                stats._classes[i]._threadCacheObjs += freeList.Size();
+                stats._classes[i]._fetchCount += freeList.FetchCount();
+                stats._classes[i]._overflowCount += freeList.OverflowCount();
+#ifdef CMP_REMOTE_FREE
+                // 远程释放栈中的和这个线程攒着还没交出去的内存块也缓存在thread cache中
+                ptrdiff_t remote = tc->_remoteObjs[i].load(std::memory_order_relaxed);
+                size_t remoteObjs = (remote > 0 ? (size_t)remote : 0) + tc->_remoteBatch[i]._count.load(std::memory_order_relaxed);
+                stats._classes[i]._threadCacheObjs += remoteObjs;
+                stats._classes[i]._remoteFreeObjs += remoteObjs;
+#endif
+            }
+        }
+    }
+
+#ifdef CMP_REMOTE_FREE
+    // 释放owner（另一个thread cache）从span中取走的内存块，size是对齐后的大小
+    // 同一个桶中连续释放给同一个owner的内存块攒成一批，一次CAS放入owner的远程释放栈
+    void DeallocateRemote(void* ptr, size_t size, ThreadCache* owner)
+    {
+        size_t index = SizeClass::Index(size);
+        RemoteBatch& batch = _remoteBatch[index];
+        if (batch._owner != owner)
+        {
+            FlushRemoteBatch(index, size);
+            batch._owner = owner;
+        }
+
+        NextObj(ptr) = batch._head;
+        if (batch._head == nullptr) batch._tail = ptr;
+        batch._head = ptr;
+
+        size_t count = batch._count.load(std::memory_order_relaxed) + 1;
+        batch._count.store(count, std::memory_order_relaxed);
+        _remoteBatchBytes.store(_remoteBatchBytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+        if (count >= std::min(REMOTE_BATCH_SIZE, SizeClass::NumMoveSize(size)))
+        {
+            FlushRemoteBatch(index, size);
+        }
+
+        // 攒着的批也算在缓存里，超过容量上限时Scavenge会把它们交出去
+        if (OverLimit())
+        {
+            Scavenge();
+        }
+    }
+
+    // 把[start, end]这n个对齐后大小为size的内存块放入index桶的远程释放栈
+    // owner线程已经退出，或者放入后owner缓存的字节数（自由链表加远程释放栈）会超过它的容量上限时返回false
+    // owner一直不申请时远程释放栈中的内存块不会被取走，有了上限才不会无限堆积
+    bool PushRemoteFrees(size_t index, void* start, void* end, size_t n, size_t size)
+    {
+        if (CachedBytes() + n * size > _maxSize.load(std::memory_order_relaxed))
+        {
+            NextObj(end) = nullptr;
+            return false;
+        }
+
+        void* head = _remoteFrees[index].load(std::memory_order_acquire);
+        do
+        {
+            if ((uintptr_t)head == REMOTE_CLOSED)
+            {
+                NextObj(end) = nullptr;
+                return false;
+            }
+            NextObj(end) = head;
+        } while (!_remoteFrees[index].compare_exchange_weak(head, start, std::memory_order_release, std::memory_order_acquire));
+
+        // 放入之后再计数，取走的线程可能先减，计数是有符号的近似值
+        _remoteObjs[index].fetch_add((ptrdiff_t)n, std::memory_order_relaxed);
+        _remoteBytes.fetch_add((ptrdiff_t)(n * size), std::memory_order_relaxed);
+        return true;
+    }
+
+    // 把这个线程每个桶攒的批都交给owner
+    void FlushRemoteBatches()
+    {
+        for (size_t i = 0; i < N_FREELISTS; ++i)
+        {
+            FlushRemoteBatch(i, SizeClass::IndexToSize(i));
+        }
+    }
+
+    // 把所有thread cache的远程释放栈中的内存块归还给central cache，ConcurrentReleaseFreeMemory时调用
+    // 远程释放栈只有owner线程申请时才会取走，owner一直不申请内存时由这里收回
+    static void ReleaseRemoteFrees()
+    {
+        std::lock_guard<std::mutex> lock(_listMtx);
+
+        for (ThreadCache* tc = _listHead; tc != nullptr; tc = tc->_nextCache)
+        {
+            for (size_t i = 0; i < N_FREELISTS; ++i)
+            {
+                size_t size = SizeClass::IndexToSize(i);
+                void* end = nullptr;
+                size_t n = 0;
+                void* start = tc->PopRemoteFrees(i, size, false, end, n);
+                if (start == nullptr) continue;
+
+                CentralCache::GetInstance(tc->_node)->ReleaseRangeObj(start, end, n, size);
+            }
+        }
+    }
+#endif
+
+    // 绑定到node节点的central cache，每CPU缓存用它把槽位绑定到对应CPU的节点
+    void SetNode(size_t node) { _node = node; }
+
+    // 设置所有thread cache合计缓存的字节数上限
+    // 调小后未分配的预算不够时，直接缩小各个thread cache的容量上限（不低于下限）把预算收回来，
+    // 它们下次释放内存时超过上限，归还多出来的内存块；缓存没有超过上限的线程自己不会交还容量
+    static void SetOverallBudget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(_listMtx);
+        _unclaimedBudget += (ptrdiff_t)bytes - (ptrdiff_t)_overallBudget;
+        _overallBudget = bytes;
+
+        for (ThreadCache* tc = _listHead; tc != nullptr && _unclaimedBudget < 0; tc = tc->_nextCache)
+        {
+            size_t maxSize = tc->_maxSize.load(std::memory_order_relaxed);
+            size_t give = std::min(maxSize - MIN_THREAD_CACHE_BYTES, (size_t)-_unclaimedBudget);
+            tc->_maxSize.store(maxSize - give, std::memory_order_relaxed);
+            _unclaimedBudget += (ptrdiff_t)give;
+        }
+    }
+
+    static size_t GetOverallBudget()
+    {
+        std::lock_guard<std::mutex> lock(_listMtx);
+        return _overallBudget;
+    }
+
+    // fork前加锁、fork后在父子进程中解锁，保证子进程中的thread cache链表和预算处于一致的状态
+    static void LockAll() { _listMtx.lock(); }
+
+    static void UnlockAll() { _listMtx.unlock(); }
+
+private:
+    // 修改缓存的字节数：只有本线程写，读改写拆成relaxed的load和store
+    void AddSize(size_t bytes) { _size.store(_size.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed); }
+
+    void SubSize(size_t bytes) { _size.store(_size.load(std::memory_order_relaxed) - bytes, std::memory_order_relaxed); }
+
+    // 缓存的字节数，其他线程交还到远程释放栈中的内存块和这个线程攒着要交给其他线程的也算在这个thread cache的缓存里
+    size_t CachedBytes() const
+    {
+        size_t size = _size.load(std::memory_order_relaxed);
+#ifdef CMP_REMOTE_FREE
+        ptrdiff_t remote = _remoteBytes.load(std::memory_order_relaxed);
+        if (remote > 0) size += (size_t)remote;
+        size += _remoteBatchBytes.load(std::memory_order_relaxed);
+#endif
+        return size;
+    }
+
+    // 缓存的字节数是否超过了容量上限
+    bool OverLimit() const
+    {
+        return CachedBytes() > _maxSize.load(std::memory_order_relaxed);
+    }
+
+    // 从freeList中取出n个内存块归还给central cache
+    void ReleaseToCentralCache(FreeList& freeList, size_t n, size_t size)
     {
         void* start = nullptr;
         void* end = nullptr;
-        freeList.PopRange(start, end, freeList.MaxSize()); // 从freeList中取出批量个小内存块
+        freeList.PopRange(start, end, n); // 从freeList中取出n个小内存块
+        SubSize(n * size);
+
+        CentralCache::GetInstance(_node)->ReleaseRangeObj(start, end, n, size); // 将批量的小内存块归还给central cache
+    }
+
+#ifdef CMP_REMOTE_FREE
+    // 把取到的内存块所在的span的owner记为自己，之后其他线程释放这些内存块时交还给这个thread cache
+    // 一批内存块通常来自同一个span，只在span变化时写一次
+    void ClaimSpans(void* start, size_t n)
+    {
+        Span* last = nullptr;
+        for (size_t i = 0; i < n; ++i, start = NextObj(start))
+        {
+            Span* span = PageCache::GetInstance()->MapObjToSpan(start);
+            if (span != last)
+            {
+                span->_owner.store(this, std::memory_order_release);
+                last = span;
+            }
+        }
+    }
+
+    // 取走index桶的远程释放栈中的全部内存块，返回链表头，end和n返回链表尾和个数，栈为空时返回nullptr
+    // close为true时同时关闭远程释放栈，只有owner线程退出时这样调用；其他时候owner线程和ReleaseRemoteFrees都可能来取，
+    // 用CAS取走，不覆盖已关闭的标记
+    void* PopRemoteFrees(size_t index, size_t size, bool close, void*& end, size_t& n)
+    {
+        void* start = nullptr;
+        if (close)
+        {
+            start = _remoteFrees[index].exchange((void*)REMOTE_CLOSED, std::memory_order_acquire);
+            if (start == nullptr || (uintptr_t)start == REMOTE_CLOSED) return nullptr;
+        }
+        else
+        {
+            start = _remoteFrees[index].load(std::memory_order_relaxed);
+            do
+            {
+                if (start == nullptr || (uintptr_t)start == REMOTE_CLOSED) return nullptr;
+            } while (!_remoteFrees[index].compare_exchange_weak(start, nullptr, std::memory_order_acquire, std::memory_order_relaxed));
+        }
+
+        end = start;
+        n = 1;
+        while (NextObj(end) != nullptr)
+        {
+            end = NextObj(end);
+            ++n;
+        }
+
+        _remoteObjs[index].fetch_sub((ptrdiff_t)n, std::memory_order_relaxed);
+        _remoteBytes.fetch_sub((ptrdiff_t)(n * size), std::memory_order_relaxed);
+        return start;
+    }
+
+    // 把index桶的远程释放栈中的内存块全部移到自由链表中，返回个数；close为true时同时关闭远程释放栈
+    size_t TakeRemoteFrees(size_t index, size_t size, bool close)
+    {
+        if (!close && _remoteFrees[index].load(std::memory_order_relaxed) == nullptr) return 0;
+
+        void* end = nullptr;
+        size_t n = 0;
+        void* start = PopRemoteFrees(index, size, close, end, n);
+        if (start == nullptr) return 0;
+
+        _freeListBucket[index].PushRange(start, end, n);
+        AddSize(n * size);
+
+        return n;
+    }
+
+    // 把index桶攒的批交给它的owner，owner已经退出或者远程释放栈已满时归还给central cache
+    void FlushRemoteBatch(size_t index, size_t size)
+    {
+        RemoteBatch& batch = _remoteBatch[index];
+        size_t count = batch._count.load(std::memory_order_relaxed);
+        if (count == 0) return;
+
+        if (!((ThreadCache*)batch._owner)->PushRemoteFrees(index, batch._head, batch._tail, count, size))
+        {
+            CentralCache::GetInstance(_node)->ReleaseRangeObj(batch._head, batch._tail, count, size);
+        }
+
+        batch._owner = nullptr;
+        batch._head = nullptr;
+        batch._tail = nullptr;
+        batch._count.store(0, std::memory_order_relaxed);
+        _remoteBatchBytes.store(_remoteBatchBytes.load(std::memory_order_relaxed) - count * size, std::memory_order_relaxed);
+    }
+#endif
+
+    // 调整这个thread cache的容量上限：总预算被调小时缩小容量还给预算，
+    // 否则先从未分配的预算中领取，没有时轮流从其他thread cache挪用
+    void AdjustCacheLimit()
+    {
+        std::lock_guard<std::mutex> lock(_listMtx);
+
+        size_t maxSize = _maxSize.load(std::memory_order_relaxed);
+        if (_unclaimedBudget < 0)
+        {
+            size_t give = std::min(maxSize - MIN_THREAD_CACHE_BYTES, (size_t)-_unclaimedBudget);
+            _maxSize.store(maxSize - give, std::memory_order_relaxed);
+            _unclaimedBudget += (ptrdiff_t)give;
+            return;
+        }
 
-        CentralCache::GetInstance()->ReleaseListToSpans(start, size); // 将批量的小内存块归还给central cache
+        if (_unclaimedBudget >= (ptrdiff_t)THREAD_CACHE_STEAL_BYTES)
+        {
+            _maxSize.store(maxSize + THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+            _unclaimedBudget -= (ptrdiff_t)THREAD_CACHE_STEAL_BYTES;
+            return;
+        }
+
+        // 最多看10个thread cache，跳过自己、已经是下限容量的和没有空闲容量的
+        for (int tries = 0; tries < 10; ++tries)
+        {
+            if (_nextSteal == nullptr) _nextSteal = _listHead;
+
+            ThreadCache* victim = _nextSteal;
+            _nextSteal = victim->_nextCache;
+
+            // 只挪用被挪用者没有用到的容量，挪用后它缓存的内存块仍然不超过上限
+            size_t victimSize = victim->_maxSize.load(std::memory_order_relaxed);
+            if (victim == this || victimSize < MIN_THREAD_CACHE_BYTES + THREAD_CACHE_STEAL_BYTES
+                || victim->CachedBytes() > victimSize - THREAD_CACHE_STEAL_BYTES) continue;
+
+            victim->_maxSize.store(victimSize - THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+            _maxSize.store(maxSize + THREAD_CACHE_STEAL_BYTES, std::memory_order_relaxed);
+            return;
+        }
     }
 
 private:
     FreeList _freeListBucket[N_FREELISTS]; // 自由链表桶
+    size_t _node = 0;                      // 所属的NUMA节点
+    std::atomic<size_t> _size{ 0 };        // 自由链表桶中缓存的总字节数，只有本线程修改，其他线程挪用容量时读取
+    std::atomic<size_t> _maxSize{ 0 };     // 容量上限，其他线程挪用容量时会修改
+    ThreadCache* _prevCache = nullptr;     // 全局thread cache链表中的前一个
+    ThreadCache* _nextCache = nullptr;     // 全局thread cache链表中的后一个
+#ifdef CMP_REMOTE_FREE
+    // 每个桶一个无锁栈，其他线程把属于这个thread cache的内存块放进来（多生产者），只有本线程整个取走（单消费者）
+    // thread cache对象的内存来自永不析构的定长内存池，线程退出后其他线程仍可以安全地看到REMOTE_CLOSED
+    std::atomic<void*> _remoteFrees[N_FREELISTS];
+    std::atomic<ptrdiff_t> _remoteObjs[N_FREELISTS]; // 每个桶的远程释放栈中的内存块数，用于统计
+    std::atomic<ptrdiff_t> _remoteBytes;             // 远程释放栈中的总字节数，和自由链表中的一起计入容量上限
+    RemoteBatch _remoteBatch[N_FREELISTS]; // 这个线程释放的、属于其他thread cache的内存块，每个桶攒一批
+    std::atomic<size_t> _remoteBatchBytes{ 0 }; // 所有桶攒的批的总字节数，只有本线程修改，其他线程挪用容量时读取
+#endif
+
+    // inline静态成员：包含这个头文件的所有编译单元共用同一份
+    inline static std::mutex _listMtx;          // 全局thread cache链表的锁，同时保护下面的预算
+    inline static ThreadCache* _listHead = nullptr;  // 全局thread cache链表的头
+    inline static ThreadCache* _nextSteal = nullptr; // 下一个被挪用容量的thread cache
+    inline static size_t _overallBudget = DEFAULT_THREAD_CACHE_BUDGET;      // 所有thread cache合计缓存的字节数上限
+    inline static ptrdiff_t _unclaimedBudget = DEFAULT_THREAD_CACHE_BUDGET; // 没有分给任何thread cache的预算，总预算调小后可能为负
 };
 
-static _declspec(thread) ThreadCache* pTLSThreadCache = nullptr; // 将pTLSThreadCache声明为线程局部存储的指针，指向ThreadCache对象
\ No newline at end of file
+// 将pTLSThreadCache声明为线程局部存储的指针，指向ThreadCache对象
+// inline变量，所有编译单元中同一个线程看到的是同一个ThreadCache
+inline thread_local ThreadCache* pTLSThreadCache = nullptr;
+
+// ThreadCache对象的定长内存池，多个线程会并发创建和归还ThreadCache
+// 同PageCache，第一次使用时构造，永不析构，线程退出时还能归还
+inline ConcurrentObjectPool<ThreadCache>* ThreadCachePool()
+{
+    alignas(ConcurrentObjectPool<ThreadCache>) static char storage[sizeof(ConcurrentObjectPool<ThreadCache>)];
+    static ConcurrentObjectPool<ThreadCache>* pool = new(storage)ConcurrentObjectPool<ThreadCache>;
+    return pool;
+}
+
+// 线程退出时析构，把线程的ThreadCache中缓存的内存归还给central cache，并把ThreadCache对象还给定长内存池
+class ThreadCacheReleaser
+{
+public:
+    void Watch() {}
+
+    ~ThreadCacheReleaser()
+    {
+        ThreadCache* tc = pTLSThreadCache;
+        if (tc == nullptr) return;
+
+        // 先置空，线程退出过程中再释放的内存直接归还给central cache
+        pTLSThreadCache = nullptr;
+        tc->ReleaseAll();
+
+        ThreadCachePool()->Delete(tc);
+    }
+};
+
+inline thread_local ThreadCacheReleaser tlsThreadCacheReleaser;
+
+// 为当前线程创建ThreadCache对象，并登记线程退出时的归还，内存不足时返回nullptr
+static ThreadCache* CreateThreadCache()
+{
+    ThreadCache* tc = ThreadCachePool()->TryNew();
+    if (tc == nullptr) return nullptr;
+
+    // 先设置TLS指针再访问tlsThreadCacheReleaser：注册线程退出回调时libc可能申请内存，
+    // 此时本线程已经有可用的ThreadCache，不会再次进入创建流程
+    pTLSThreadCache = tc;
+    tlsThreadCacheReleaser.Watch();
+
+    return tc;
+}
\ No newline at end of file
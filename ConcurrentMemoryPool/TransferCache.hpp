@@ -0,0 +1,113 @@
+#pragma once
+
+#include "Common.hpp"
+
+static const size_t TRANSFER_CACHE_SLOTS = 64;          // 每个size class的transfer cache最多缓存的批次数
+static const size_t TRANSFER_CACHE_BYTES = 1024 * 1024; // 每个size class的transfer cache最多缓存的字节数
+
+// transfer cache位于thread cache和central cache的span之间
+// 它按size class缓存已经串好的批次（每批最多NumMoveSize个），一个线程归还的一批内存块
+// 可以原封不动地交给另一个线程，不需要加central cache的桶锁，也不需要遍历span的自由链表
+// 慢开始阶段的thread cache申请和归还的批次不满一整批，放入时和栈顶不满的批次合并，取出时从栈顶的批次中拆分
+class TransferCache
+{
+public:
+	// 放入[start, end]这n个内存块，end的NextObj为空，n超过一整批或者缓存满了返回false
+	bool Insert(void* start, void* end, size_t n, size_t size)
+	{
+		size_t batchSize = SizeClass::NumMoveSize(size);
+		if (n > batchSize) return false;
+
+		std::lock_guard<SpinLock> lock(_lock);
+
+		// 栈顶的批次还放得下时接在它的前面，不占新的槽位
+		if (_used > 0 && _slots[_used - 1]._count + n <= batchSize)
+		{
+			Batch& top = _slots[_used - 1];
+			NextObj(end) = top._start;
+			top._start = start;
+			top._count += n;
+			return true;
+		}
+
+		if (_used >= Capacity(batchSize * size)) return false;
+
+		_slots[_used]._start = start;
+		_slots[_used]._end = end;
+		_slots[_used]._count = n;
+		++_used;
+
+		return true;
+	}
+
+	// 取出最多n个内存块，返回取出的个数，缓存为空时返回0
+	// 栈顶的批次比n多时从它的头部拆出n个，剩下的留在槽位中
+	size_t Remove(void*& start, void*& end, size_t n)
+	{
+		std::lock_guard<SpinLock> lock(_lock);
+
+		if (_used == 0) return 0;
+
+		Batch& top = _slots[_used - 1];
+		if (top._count <= n)
+		{
+			--_used;
+			start = top._start;
+			end = top._end;
+			return top._count;
+		}
+
+		start = top._start;
+		end = start;
+		for (size_t i = 1; i < n; ++i)
+		{
+			end = NextObj(end);
+		}
+		top._start = NextObj(end);
+		top._count -= n;
+		NextObj(end) = nullptr;
+
+		return n;
+	}
+
+	// 缓存的内存块数
+	size_t Size()
+	{
+		std::lock_guard<SpinLock> lock(_lock);
+
+		size_t objs = 0;
+		for (size_t i = 0; i < _used; ++i)
+		{
+			objs += _slots[i]._count;
+		}
+		return objs;
+	}
+
+	// fork前加锁、fork后解锁
+	void Lock() { _lock.lock(); }
+
+	void Unlock() { _lock.unlock(); }
+
+private:
+	// 按一整批内存块的字节数计算能缓存的批次数，大对象的批次少缓存一些
+	static size_t Capacity(size_t batchBytes)
+	{
+		size_t slots = TRANSFER_CACHE_BYTES / batchBytes;
+		if (slots < 1) slots = 1;
+		if (slots > TRANSFER_CACHE_SLOTS) slots = TRANSFER_CACHE_SLOTS;
+
+		return slots;
+	}
+
+	// 一批串好的内存块
+	struct Batch
+	{
+		void* _start;
+		void* _end;
+		size_t _count; // 这一批的内存块数，不超过NumMoveSize
+	};
+
+	SpinLock _lock;                     // 槽位的自旋锁，临界区只有一次槽位交换
+	size_t _used = 0;                   // 已经使用的槽位数
+	Batch _slots[TRANSFER_CACHE_SLOTS]; // 缓存的批次，按栈的方式使用，最近放入的最先取出
+};
\ No newline at end of file
@@ -0,0 +1,278 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <thread>
+#include <atomic>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// 通过LD_PRELOAD=./libcmpool.so运行，测试替换后的malloc系列函数的错误路径
+// 不包含内存池的头文件，只通过libc的接口调用，和普通程序使用libcmpool.so的方式相同
+// 申请失败时要返回NULL并设置errno，不能在内存池内部抛异常或者死锁，alarm防止死锁时测试一直挂起
+
+static int failures = 0;
+
+#define CHECK(cond)                                                              \
+	do                                                                           \
+	{                                                                            \
+		if (!(cond))                                                             \
+		{                                                                        \
+			fprintf(stderr, "%s:%d: CHECK(%s) 失败\n", __FILE__, __LINE__, #cond); \
+			++failures;                                                          \
+		}                                                                        \
+	} while (0)
+
+// 编译器知道malloc的语义，申请的大小经过volatile变量传入，避免调用被优化掉
+static volatile size_t hugeSize = (size_t)1 << 50;
+static volatile size_t maxSize = SIZE_MAX;
+
+// 内存池的大块内存按8KB的页分配，glibc的大块内存起始地址不是8KB对齐的
+static bool PreloadActive()
+{
+	void* ptr = malloc(1024 * 1024);
+	bool active = ((uintptr_t)ptr & 8191) == 0;
+	free(ptr);
+
+	return active;
+}
+
+// malloc、calloc、realloc申请不到内存时返回NULL，errno为ENOMEM
+static void TestMalloc()
+{
+	errno = 0;
+	CHECK(malloc(hugeSize) == nullptr);
+	CHECK(errno == ENOMEM);
+
+	errno = 0;
+	CHECK(malloc(maxSize) == nullptr);
+	CHECK(errno == ENOMEM);
+
+	errno = 0;
+	CHECK(malloc(maxSize - 4096) == nullptr);
+	CHECK(errno == ENOMEM);
+
+	errno = 0;
+	CHECK(calloc(maxSize / 2, 4) == nullptr);
+	CHECK(errno == ENOMEM);
+
+	errno = 0;
+	CHECK(calloc(1, hugeSize) == nullptr);
+	CHECK(errno == ENOMEM);
+
+	// 失败后内存池仍然可以正常使用
+	char* ptr = (char*)malloc(100);
+	CHECK(ptr != nullptr);
+	memset(ptr, 'a', 100);
+
+	// realloc失败时原来的内存保持不变
+	const size_t sizes[] = { maxSize, hugeSize };
+	for (size_t i = 0; i < 2; ++i)
+	{
+		errno = 0;
+		char* newPtr = (char*)realloc(ptr, sizes[i]);
+		CHECK(newPtr == nullptr);
+		CHECK(errno == ENOMEM);
+		if (newPtr != nullptr) ptr = newPtr;
+	}
+	CHECK(ptr[0] == 'a' && ptr[99] == 'a');
+
+	free(ptr);
+}
+
+// 对齐申请的各个入口
+static void TestMemalign()
+{
+	errno = 0;
+	CHECK(memalign(64, maxSize) == nullptr);
+	CHECK(errno == ENOMEM);
+
+	errno = 0;
+	CHECK(memalign(1 << 20, hugeSize) == nullptr);
+	CHECK(errno == ENOMEM);
+
+	errno = 0;
+	CHECK(memalign((size_t)1 << 63, 16) == nullptr);
+	CHECK(errno == ENOMEM);
+
+	errno = 0;
+	CHECK(memalign(48, 16) == nullptr);
+	CHECK(errno == EINVAL);
+
+	void* ptr = nullptr;
+	CHECK(posix_memalign(&ptr, 4096, maxSize) == ENOMEM);
+	CHECK(posix_memalign(&ptr, 4096, hugeSize) == ENOMEM);
+	CHECK(posix_memalign(&ptr, 3, 16) == EINVAL);
+	CHECK(ptr == nullptr);
+
+	errno = 0;
+	CHECK(aligned_alloc(4096, maxSize) == nullptr);
+	CHECK(errno == ENOMEM);
+
+	errno = 0;
+	CHECK(valloc(maxSize) == nullptr);
+	CHECK(errno == ENOMEM);
+
+	// 向上取整到页大小时会溢出
+	errno = 0;
+	CHECK(pvalloc(maxSize - 1) == nullptr);
+	CHECK(errno == ENOMEM);
+
+	CHECK(posix_memalign(&ptr, 1 << 16, 100) == 0);
+	CHECK(((uintptr_t)ptr & ((1 << 16) - 1)) == 0);
+	free(ptr);
+}
+
+// operator new失败时抛出bad_alloc，nothrow版本返回nullptr
+static void TestOperatorNew()
+{
+	bool thrown = false;
+	try
+	{
+		void* ptr = operator new(hugeSize);
+		operator delete(ptr);
+	}
+	catch (const std::bad_alloc&)
+	{
+		thrown = true;
+	}
+	CHECK(thrown);
+
+	thrown = false;
+	try
+	{
+		void* ptr = operator new(maxSize, std::align_val_t(64));
+		operator delete(ptr, std::align_val_t(64));
+	}
+	catch (const std::bad_alloc&)
+	{
+		thrown = true;
+	}
+	CHECK(thrown);
+
+	CHECK(operator new(maxSize, std::nothrow) == nullptr);
+	CHECK(operator new[](hugeSize, std::nothrow) == nullptr);
+	CHECK(operator new(maxSize, std::align_val_t(1 << 16), std::nothrow) == nullptr);
+}
+
+// 限制地址空间后一直申请到内存耗尽：小块内存在thread cache、central cache、page cache的各层失败时都返回NULL，
+// 不死锁；全部释放后还能继续申请。在子进程中执行，不影响其他用例
+static void TestExhaustion()
+{
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		alarm(20);
+		struct rlimit limit = { 256 << 20, 256 << 20 };
+		setrlimit(RLIMIT_AS, &limit);
+
+		const size_t sizes[] = { 64, 5000, 200 * 1024 };
+		for (size_t k = 0; k < 3; ++k)
+		{
+			void* head = nullptr;
+			void* ptr = nullptr;
+			errno = 0;
+			while ((ptr = malloc(sizes[k])) != nullptr)
+			{
+				*(void**)ptr = head;
+				head = ptr;
+			}
+			if (errno != ENOMEM || head == nullptr) _exit(1);
+
+			while (head != nullptr)
+			{
+				void* next = *(void**)head;
+				free(head);
+				head = next;
+			}
+		}
+
+		void* ptr = malloc(100);
+		_exit(ptr != nullptr ? 0 : 1);
+	}
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// 其他线程不停地申请释放时fork，子进程中的锁不能处于被持有的状态
+// 工作线程每轮申请的内存块超过thread cache的缓存量，频繁进出central cache和page cache的锁
+static void TestFork()
+{
+	const size_t sizes[] = { 16, 200, 3000, 300 * 1024 };
+	const size_t n = 2048;
+
+	std::atomic<bool> stop(false);
+	std::thread workers[4];
+	for (auto& worker : workers)
+	{
+		worker = std::thread([&]() {
+			void** ptrs = (void**)malloc(n * sizeof(void*));
+			for (size_t round = 0; !stop.load(std::memory_order_relaxed); ++round)
+			{
+				size_t size = sizes[round % 4];
+				size_t count = size > 256 * 1024 ? 8 : n;
+				for (size_t i = 0; i < count; ++i) ptrs[i] = malloc(size);
+				for (size_t i = 0; i < count; ++i) free(ptrs[i]);
+			}
+			free(ptrs);
+		});
+	}
+
+	for (int i = 0; i < 200; ++i)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			// 子进程中申请释放同样大小的内存，死锁时alarm会结束子进程
+			alarm(2);
+			for (size_t k = 0; k < 4; ++k)
+			{
+				void* ptrs[64];
+				for (size_t j = 0; j < 64; ++j) ptrs[j] = malloc(sizes[k]);
+				for (size_t j = 0; j < 64; ++j) free(ptrs[j]);
+			}
+			_exit(0);
+		}
+
+		int status = 0;
+		waitpid(pid, &status, 0);
+		bool exited = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		CHECK(exited);
+		if (!exited) break;
+	}
+
+	stop.store(true);
+	for (auto& worker : workers) worker.join();
+}
+
+int main()
+{
+	alarm(60);
+
+	if (!PreloadActive())
+	{
+		fprintf(stderr, "需要通过LD_PRELOAD=./libcmpool.so运行\n");
+		return 1;
+	}
+
+	TestMalloc();
+	TestMemalign();
+	TestOperatorNew();
+	TestExhaustion();
+	TestFork();
+
+	if (failures > 0)
+	{
+		fprintf(stderr, "%d个检查失败\n", failures);
+		return 1;
+	}
+
+	printf("所有测试通过\n");
+	return 0;
+}
\ No newline at end of file
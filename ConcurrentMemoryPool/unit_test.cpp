@@ -1,200 +1,918 @@
-//#include <iostream>
-//#include <vector>
-//#include <thread>
-//
-//#include "ObjectPool.hpp"
-//#include "ConcurrentAlloc.hpp"
-//
-//struct TreeNode
-//{
-//    int _val;
-//    TreeNode* _left;
-//    TreeNode* _right;
-//
-//    TreeNode()
-//        :_val(0)
-//        , _left(nullptr)
-//        , _right(nullptr)
-//    {}
-//};
-//
-//void TestObjectPool()
-//{
-//    // 申请释放的轮次
-//    const size_t Rounds = 3;
-//
-//    // 每轮申请释放多少次
-//    const size_t N = 10000;
-//    size_t begin1 = clock();
-//    std::vector<TreeNode* > v1;
-//    v1.reserve(N);
-//
-//    for (size_t j = 0; j < Rounds; ++j)
-//    {
-//        for (int i = 0; i < N; ++i) v1.push_back(new TreeNode);
-//        for (int i = 0; i < N; ++i) delete v1[i];
-//        v1.clear();
-//    }
-//
-//    size_t end1 = clock();
-//    ObjectPool<TreeNode> TNPool;
-//    size_t begin2 = clock();
-//    std::vector<TreeNode*> v2;
-//    v2.reserve(N);
-//
-//    for (size_t j = 0; j < Rounds; ++j)
-//    {
-//        for (int i = 0; i < N; ++i) v2.push_back(TNPool.New());
-//        for (int i = 0; i < N; ++i) TNPool.Delete(v2[i]);
-//        v2.clear();
-//    }
-//
-//    size_t end2 = clock();
-//    std::cout << "new cost time:" << end1 - begin1 << std::endl;
-//    std::cout << "object pool cost time:" << end2 - begin2 << std::endl;
-//}
-//
-//void Alloc1()
-//{
-//    for (int i = 0; i < 5; ++i)
-//    {
-//        void* ptr = ConcurrentAlloc(5);
-//    }
-//}
-//
-//void Alloc2()
-//{
-//    for (int i = 0; i < 5; ++i)
-//    {
-//        void* ptr = ConcurrentAlloc(7);
-//    }
-//}
-//
-//void TLSTest()
-//{
-//    std::thread t1(Alloc1);
-//    std::thread t2(Alloc2);
-//
-//    t1.join();
-//    t2.join();
-//}
-//
-//void TestConcurrentAlloc1()
-//{
-//    void* p1 = ConcurrentAlloc(6);
-//    void* p2 = ConcurrentAlloc(8);
-//    void* p3 = ConcurrentAlloc(1);
-//    void* p4 = ConcurrentAlloc(7);
-//    void* p5 = ConcurrentAlloc(8);
-//    void* p6 = ConcurrentAlloc(2);
-//    void* p7 = ConcurrentAlloc(1);
-//
-//    std::cout << p1 << std::endl;
-//    std::cout << p2 << std::endl;
-//    std::cout << p3 << std::endl;
-//    std::cout << p4 << std::endl;
-//    std::cout << p5 << std::endl;
-//    std::cout << p6 << std::endl;
-//    std::cout << p7 << std::endl;
-//}
-//
-//void TestConcurrentAlloc2()
-//{
-//    for (size_t i = 0; i < 1024; ++i)
-//    {
-//        void* p1 = ConcurrentAlloc(6);
-//    }
-//
-//    void* p2 = ConcurrentAlloc(8);
-//    std::cout << p2 << std::endl;
-//}
-//
-//void TestConcurrentFree()
-//{
-//    void* p1 = ConcurrentAlloc(6);
-//    void* p2 = ConcurrentAlloc(8);
-//    void* p3 = ConcurrentAlloc(1);
-//    void* p4 = ConcurrentAlloc(7);
-//    void* p5 = ConcurrentAlloc(8);
-//    void* p6 = ConcurrentAlloc(2);
-//    void* p7 = ConcurrentAlloc(1);
-//
-//    std::cout << p1 << std::endl;
-//    std::cout << p2 << std::endl;
-//    std::cout << p3 << std::endl;
-//    std::cout << p4 << std::endl;
-//    std::cout << p5 << std::endl;
-//
-//    ConcurrentFree(p1);
-//    ConcurrentFree(p2);
-//    ConcurrentFree(p3);
-//    ConcurrentFree(p4);
-//    ConcurrentFree(p5);
-//    ConcurrentFree(p6);
-//    ConcurrentFree(p7);
-//}
-//
-//void MultiThreadAlloc1()
-//{
-//    std::vector<void*> vt;
-//    for (int i = 0; i < 7; ++i)
-//    {
-//        void* ptr = ConcurrentAlloc(6);
-//        vt.push_back(ptr);
-//    }
-//
-//    for (auto e : vt)
-//    {
-//        ConcurrentFree(e);
-//    }
-//}
-//
-//void MultiThreadAlloc2()
-//{
-//    std::vector<void*> vt;
-//    for (int i = 0; i < 7; ++i)
-//    {
-//        void* ptr = ConcurrentAlloc(7);
-//        vt.push_back(ptr);
-//    }
-//
-//    for (auto e : vt)
-//    {
-//        ConcurrentFree(e);
-//    }
-//}
-//
-//void TestMultiThread()
-//{
-//    std::thread t1(MultiThreadAlloc1);
-//    std::thread t2(MultiThreadAlloc2);
-//
-//    t1.join();
-//    t2.join();
-//}
-//
-//void BigAlloc()
-//{
-//    void* p1 = ConcurrentAlloc(257 * 1024);
-//    ConcurrentFree(p1);
-//
-//    void* p2 = ConcurrentAlloc(129 * 8 * 1024);
-//    ConcurrentFree(p2);
-//}
-//
-////int main()
-////{
-////    //TestObjectPool();
-////    //TLSTest();
-////
-////    //TestConcurrentAlloc1();
-////    //TestConcurrentAlloc2();
-////
-////    TestConcurrentFree();
-////
-////    //TestMultiThread();
-////
-////    BigAlloc();
-////
-////    return 0;
-////}
\ No newline at end of file
+#include "ConcurrentAlloc.hpp"
+#include "ConcurrentAllocator.hpp"
+#include <cstdio>
+#include <vector>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <random>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// 内存池的单元测试，make test编译并运行所有变体
+// 不依赖测试框架：CHECK失败时打印位置并计数，所有用例跑完后有失败则返回非0
+
+static int failures = 0;
+
+#define CHECK(cond)                                                              \
+	do                                                                           \
+	{                                                                            \
+		if (!(cond))                                                             \
+		{                                                                        \
+			fprintf(stderr, "%s:%d: CHECK(%s) 失败\n", __FILE__, __LINE__, #cond); \
+			++failures;                                                          \
+		}                                                                        \
+	} while (0)
+
+// 用和地址相关的内容填满内存块，之后校验，用来发现两个内存块重叠或者内容被改写
+static void Fill(void* ptr, size_t size, unsigned char seed)
+{
+	unsigned char* p = (unsigned char*)ptr;
+	for (size_t i = 0; i < size; ++i) p[i] = (unsigned char)(seed + i * 31);
+}
+
+static bool Verify(void* ptr, size_t size, unsigned char seed)
+{
+	unsigned char* p = (unsigned char*)ptr;
+	for (size_t i = 0; i < size; ++i)
+	{
+		if (p[i] != (unsigned char)(seed + i * 31)) return false;
+	}
+	return true;
+}
+
+// 各个区间的小块内存和大块内存：申请、写满、校验、释放
+static void TestAllocFree()
+{
+	const size_t sizes[] = { 1, 7, 8, 128, 129, 1000, 1024, 1025, 8 * 1024, 64 * 1024 + 1, MAX_BYTES, MAX_BYTES + 1, 1024 * 1024, 3 * 1024 * 1024 + 5 };
+
+	std::vector<void*> ptrs;
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+	{
+		void* ptr = ConcurrentAlloc(sizes[i]);
+		CHECK(ptr != nullptr);
+		CHECK(ConcurrentUsableSize(ptr) >= sizes[i]);
+		Fill(ptr, sizes[i], (unsigned char)i);
+		ptrs.push_back(ptr);
+	}
+
+	for (size_t i = 0; i < ptrs.size(); ++i)
+	{
+		CHECK(Verify(ptrs[i], sizes[i], (unsigned char)i));
+		ConcurrentFree(ptrs[i]);
+	}
+}
+
+// 带大小的释放：每个size class的边界附近各申请一次，按申请时的大小释放
+static void TestSizedFree()
+{
+	std::vector<std::pair<void*, size_t>> ptrs;
+	for (size_t size = 1; size <= MAX_BYTES + 3 * (1 << PAGE_SHIFT); size += size < 1024 ? 7 : size / 5)
+	{
+		void* ptr = ConcurrentAlloc(size);
+		Fill(ptr, size, (unsigned char)size);
+		ptrs.push_back(std::make_pair(ptr, size));
+	}
+
+	for (auto& it : ptrs)
+	{
+		CHECK(Verify(it.first, it.second, (unsigned char)it.second));
+		ConcurrentFree(it.first, it.second);
+	}
+
+	// 同一个size class的内存块释放后被重新使用
+	void* ptr = ConcurrentAlloc(100);
+	ConcurrentFree(ptr, 100);
+	void* again = ConcurrentAlloc(100);
+	CHECK(again == ptr);
+	ConcurrentFree(again, 100);
+}
+
+// 对齐申请：从8字节到超过一页的对齐，分别按带大小和不带大小两种方式释放
+static void TestAligned()
+{
+	for (size_t align = 8; align <= ((size_t)1 << PAGE_SHIFT) * 8; align <<= 1)
+	{
+		for (size_t size : { (size_t)1, (size_t)24, align - 1, align + 1, (size_t)5000, (size_t)300 * 1024 })
+		{
+			void* ptr = ConcurrentAllocAligned(size, align);
+			CHECK(((uintptr_t)ptr & (align - 1)) == 0);
+			CHECK(ConcurrentUsableSize(ptr) >= size);
+			Fill(ptr, size, 3);
+			CHECK(Verify(ptr, size, 3));
+
+			if (size & 1) ConcurrentFreeAligned(ptr, size, align);
+			else ConcurrentFree(ptr);
+		}
+	}
+}
+
+// realloc：小块内存内部扩缩、小块和大块之间互相转换、大块内存原地扩展和缩小，内容都要保留
+static void TestRealloc()
+{
+	void* ptr = ConcurrentRealloc(nullptr, 10);
+	Fill(ptr, 10, 1);
+
+	// 同一个size class内调整大小直接返回原地址
+	CHECK(ConcurrentRealloc(ptr, 12) == ptr);
+
+	size_t oldSize = 10;
+	const size_t sizes[] = { 200, 5000, 100 * 1024, MAX_BYTES + 100, 2 * 1024 * 1024, 16 * 1024 * 1024, 10 * 1024 * 1024, 3 * 1024 * 1024, 700, 16 };
+	for (size_t newSize : sizes)
+	{
+		ptr = ConcurrentRealloc(ptr, newSize);
+		CHECK(ptr != nullptr);
+		CHECK(ConcurrentUsableSize(ptr) >= newSize);
+		CHECK(Verify(ptr, std::min(oldSize, newSize), 1));
+
+		Fill(ptr, newSize, 1);
+		oldSize = newSize;
+	}
+
+	ConcurrentFree(ptr);
+}
+
+// 批量接口：整批申请的内存块互不重叠，再和单个申请的内存块混在一起整批释放
+static void TestBatch()
+{
+	const size_t n = 1000;
+	for (size_t size : { (size_t)8, (size_t)48, (size_t)1000, (size_t)20000, MAX_BYTES + 1 })
+	{
+		size_t count = size > MAX_BYTES ? 16 : n;
+		std::vector<void*> ptrs(count);
+		ConcurrentAllocBatch(size, count, ptrs.data());
+
+		std::vector<void*> sorted(ptrs);
+		std::sort(sorted.begin(), sorted.end());
+		CHECK(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+		for (size_t i = 1; i < count; ++i)
+		{
+			CHECK((char*)sorted[i - 1] + size <= (char*)sorted[i]);
+		}
+
+		for (size_t i = 0; i < count; ++i) Fill(ptrs[i], size, (unsigned char)i);
+		for (size_t i = 0; i < count; ++i) CHECK(Verify(ptrs[i], size, (unsigned char)i));
+
+		// 每隔几个插入一个其他大小的内存块，整批释放时要按size class分段
+		std::vector<void*> mixed;
+		for (size_t i = 0; i < count; ++i)
+		{
+			mixed.push_back(ptrs[i]);
+			if (i % 7 == 0) mixed.push_back(ConcurrentAlloc(i % 3 == 0 ? 64 : 300 * 1024));
+		}
+		ConcurrentFreeBatch(mixed.data(), mixed.size());
+	}
+
+	ConcurrentFreeBatch(nullptr, 0);
+}
+
+// 一个线程申请、另一个线程释放，内存块跨线程流动
+static void TestCrossThread()
+{
+	const size_t n = 20000;
+	std::vector<void*> ptrs(n);
+
+	std::thread producer([&]() {
+		for (size_t i = 0; i < n; ++i)
+		{
+			ptrs[i] = ConcurrentAlloc(i % 512 + 1);
+			Fill(ptrs[i], i % 512 + 1, (unsigned char)i);
+		}
+	});
+	producer.join();
+
+	std::thread consumer([&]() {
+		for (size_t i = 0; i < n; ++i)
+		{
+			CHECK(Verify(ptrs[i], i % 512 + 1, (unsigned char)i));
+			if (i & 1) ConcurrentFree(ptrs[i]);
+			else ConcurrentFree(ptrs[i], i % 512 + 1);
+		}
+	});
+	consumer.join();
+}
+
+// ConcurrentObjectPool的测试对象，_check记录对象自己的地址，两个存活的对象重叠时会被改写
+struct PoolNode
+{
+	uintptr_t _check;
+	char _payload[40];
+
+	PoolNode() :_check((uintptr_t)this) { Fill(_payload, sizeof(_payload), (unsigned char)_check); }
+	bool Valid() const { return _check == (uintptr_t)this && Verify((void*)_payload, sizeof(_payload), (unsigned char)_check); }
+};
+
+// 多个线程并发New和Delete，对象通过共享的槽位交换，大部分在别的线程Delete
+static void TestObjectPoolContention()
+{
+	ConcurrentObjectPool<PoolNode> pool;
+	const size_t nthreads = 4, rounds = 50000, nslots = 64;
+	std::atomic<PoolNode*> slots[nslots];
+	for (size_t i = 0; i < nslots; ++i) slots[i].store(nullptr);
+
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < nthreads; ++t)
+	{
+		threads.emplace_back([&, t]() {
+			for (size_t i = 0; i < rounds; ++i)
+			{
+				PoolNode* old = slots[(i * 7 + t) % nslots].exchange(pool.New());
+				if (old)
+				{
+					CHECK(old->Valid());
+					pool.Delete(old);
+				}
+			}
+		});
+	}
+	for (auto& th : threads) th.join();
+
+	for (size_t i = 0; i < nslots; ++i)
+	{
+		if (PoolNode* node = slots[i].load())
+		{
+			CHECK(node->Valid());
+			pool.Delete(node);
+		}
+	}
+}
+
+// 线程退出时弹匣中的对象放回全局仓库，其他线程之后New拿到的是这些对象，而不是再切新的内存
+static void TestObjectPoolThreadExit()
+{
+	ConcurrentObjectPool<PoolNode> pool;
+	std::set<PoolNode*> freed;
+
+	// 个数小于弹匣容量，线程退出前对象都留在它的弹匣中
+	std::thread([&]() {
+		std::vector<PoolNode*> nodes;
+		for (size_t i = 0; i < 10; ++i) nodes.push_back(pool.New());
+		for (PoolNode* node : nodes)
+		{
+			freed.insert(node);
+			pool.Delete(node);
+		}
+	}).join();
+
+	PoolNode* node = pool.New();
+	CHECK(freed.count(node) == 1);
+	pool.Delete(node);
+}
+
+// 池析构后新建的池复用了它的槽位：线程弹匣和线程退出时的归还都要按代号丢弃旧池留下的对象，
+// 否则新池会用到已经还给系统的内存，或者把同一个对象交出去两次
+static void TestObjectPoolSlotReuse()
+{
+	ConcurrentObjectPool<PoolNode>* oldPool = new ConcurrentObjectPool<PoolNode>;
+
+	// 主线程和一个还没退出的线程的弹匣中都留着旧池的对象
+	auto fillMagazine = [&]() {
+		std::vector<PoolNode*> nodes;
+		for (size_t i = 0; i < 10; ++i) nodes.push_back(oldPool->New());
+		for (PoolNode* node : nodes) oldPool->Delete(node);
+	};
+	fillMagazine();
+
+	std::atomic<int> step{ 0 };
+	std::thread th([&]() {
+		fillMagazine();
+		step = 1;
+		while (step != 2) std::this_thread::yield();
+	});
+	while (step != 1) std::this_thread::yield();
+
+	delete oldPool;
+	ConcurrentObjectPool<PoolNode> pool;
+	step = 2;
+	th.join();
+
+	std::set<PoolNode*> live;
+	for (size_t i = 0; i < 100; ++i)
+	{
+		PoolNode* node = pool.New();
+		CHECK(live.insert(node).second);
+	}
+	for (PoolNode* node : live)
+	{
+		CHECK(node->Valid());
+		pool.Delete(node);
+	}
+}
+
+// 把buffer中从first开始的n个size字节的内存块串成链表，返回链表尾
+static void* Chain(char* buffer, size_t first, size_t n, size_t size)
+{
+	for (size_t i = first; i < first + n - 1; ++i)
+	{
+		NextObj(buffer + i * size) = buffer + (i + 1) * size;
+	}
+	NextObj(buffer + (first + n - 1) * size) = nullptr;
+	return buffer + (first + n - 1) * size;
+}
+
+// 链表中的内存块数，同时检查end是最后一个
+static size_t ChainLength(void* start, void* end)
+{
+	size_t n = 1;
+	for (; start != end; start = NextObj(start)) ++n;
+	return NextObj(end) == nullptr ? n : 0;
+}
+
+// transfer cache接收不满一整批的批次：放入时和栈顶的批次合并，取出时按请求的个数拆分
+static void TestTransferCache()
+{
+	const size_t size = 64;
+	const size_t batchSize = SizeClass::NumMoveSize(size);
+	std::vector<char> buffer(batchSize * 4 * size);
+	TransferCache cache;
+	void* start = nullptr;
+	void* end = nullptr;
+
+	CHECK(cache.Remove(start, end, batchSize) == 0);
+	CHECK(!cache.Insert(buffer.data(), Chain(buffer.data(), 0, batchSize + 1, size), batchSize + 1, size));
+
+	// 3个和2个合并成一批
+	CHECK(cache.Insert(buffer.data(), Chain(buffer.data(), 0, 3, size), 3, size));
+	CHECK(cache.Insert(buffer.data() + 3 * size, Chain(buffer.data(), 3, 2, size), 2, size));
+	CHECK(cache.Size() == 5);
+
+	// 从合并的批次中拆出4个，剩下1个
+	CHECK(cache.Remove(start, end, 4) == 4);
+	CHECK(ChainLength(start, end) == 4);
+	CHECK(cache.Size() == 1);
+	CHECK(cache.Remove(start, end, 4) == 1);
+	CHECK(start == end && NextObj(end) == nullptr);
+	CHECK(cache.Size() == 0);
+
+	// 栈顶是整批时不合并，另占一个槽位，取出时先取最近放入的
+	CHECK(cache.Insert(buffer.data(), Chain(buffer.data(), 0, batchSize, size), batchSize, size));
+	CHECK(cache.Insert(buffer.data() + batchSize * size, Chain(buffer.data(), batchSize, 1, size), 1, size));
+	CHECK(cache.Size() == batchSize + 1);
+	CHECK(cache.Remove(start, end, batchSize) == 1 && start == buffer.data() + batchSize * size);
+	CHECK(cache.Remove(start, end, batchSize) == batchSize && ChainLength(start, end) == batchSize);
+	CHECK(cache.Size() == 0);
+}
+
+// 用户手中的内存块数：从span中分配出去的，减去各级缓存中的
+static size_t InUseObjs(size_t index)
+{
+	AllocatorStats stats = GetAllocatorStats();
+	const SizeClassStats& cls = stats._classes[index];
+	return cls._centralUsedObjs - cls._threadCacheObjs - cls._transferCacheObjs;
+}
+
+// 内存块在span和各级缓存之间往返：每个size class申请几个span的内存块，乱序释放后全部回到span或缓存中，
+// span中每个内存块的空闲标记（链表或位图）都要正确恢复，unit_test_bitmap用位图格式运行同样的用例
+static void TestSpanRoundTrip()
+{
+	// 不开加固时8字节的span正好切出MAX_SPAN_OBJECTS个内存块，位图的每一位都会用到
+	for (size_t size : { (size_t)8, (size_t)24, (size_t)1000, (size_t)9000, MAX_BYTES / 2 })
+	{
+		// 加固模式下内存块多出canary，按实际向内存池申请的大小找size class
+		size_t objSize = HardenedSize(size);
+		size_t index = SizeClass::Index(objSize);
+		size_t before = InUseObjs(index);
+
+		std::thread worker([&]() {
+			size_t capacity = (SizeClass::NumMovePage(objSize) << PAGE_SHIFT) / SizeClass::RoundUp(objSize);
+			std::vector<void*> ptrs(capacity * 3);
+			for (size_t i = 0; i < ptrs.size(); ++i)
+			{
+				ptrs[i] = ConcurrentAlloc(size);
+				Fill(ptrs[i], size, (unsigned char)i);
+			}
+			CHECK(InUseObjs(index) == before + ptrs.size());
+
+			std::shuffle(ptrs.begin(), ptrs.end(), std::mt19937(42));
+			std::vector<void*> sorted(ptrs);
+			std::sort(sorted.begin(), sorted.end());
+			for (size_t i = 1; i < sorted.size(); ++i)
+			{
+				CHECK((char*)sorted[i - 1] + size <= (char*)sorted[i]);
+			}
+
+			for (void* ptr : ptrs) ConcurrentFree(ptr);
+		});
+		worker.join();
+
+		CHECK(InUseObjs(index) == before);
+	}
+}
+
+// 一个线程申请后一直不再申请，另一个线程释放这些内存块：释放的内存块不论缓存在哪里都要计入统计
+// 开启CMP_REMOTE_FREE时它们交还给申请的线程，远程释放栈不超过这个线程的容量上限，ConcurrentReleaseFreeMemory把它们收回
+static void TestRemoteFree()
+{
+	const size_t size = 1000;
+	size_t index = SizeClass::Index(HardenedSize(size));
+	size_t before = InUseObjs(index);
+
+	std::vector<void*> ptrs(4096);
+	std::atomic<int> stage(0);
+	std::thread owner([&]() {
+		for (auto& ptr : ptrs) ptr = ConcurrentAlloc(size);
+		stage.store(1);
+		while (stage.load() != 2) std::this_thread::yield();
+	});
+	while (stage.load() != 1) std::this_thread::yield();
+
+	for (void* ptr : ptrs) ConcurrentFree(ptr);
+	CHECK(InUseObjs(index) == before);
+
+#ifdef CMP_REMOTE_FREE
+	// 申请的线程从来没有释放过，容量上限还是初始的下限，另外最多还有一批攒在释放的线程中
+	const size_t objSize = SizeClass::RoundUp(HardenedSize(size));
+	CHECK(GetAllocatorStats()._classes[index]._remoteFreeObjs * objSize <= MIN_THREAD_CACHE_BYTES + REMOTE_BATCH_SIZE * objSize);
+#endif
+
+	ConcurrentReleaseFreeMemory();
+	CHECK(GetAllocatorStats()._classes[index]._remoteFreeObjs == 0);
+	CHECK(InUseObjs(index) == before);
+
+	stage.store(2);
+	owner.join();
+}
+
+// 线程退出时归还的整批内存块留在transfer cache中，ConcurrentReleaseFreeMemory要把它们归还给span，
+// 空出来的span回到page cache后物理页才能归还
+static void TestReleaseFreeMemory()
+{
+	const size_t size = 4000;
+	size_t index = SizeClass::Index(size);
+
+	std::thread worker([&]() {
+		std::vector<void*> ptrs(20000);
+		for (auto& ptr : ptrs) ptr = ConcurrentAlloc(size);
+		for (auto& ptr : ptrs) ConcurrentFree(ptr);
+	});
+	worker.join();
+
+	CHECK(GetAllocatorStats()._classes[index]._transferCacheObjs > 0);
+
+	CHECK(ConcurrentReleaseFreeMemory() > 0);
+
+	AllocatorStats stats = GetAllocatorStats();
+	CHECK(stats._classes[index]._transferCacheObjs == 0);
+	CHECK(stats._pageCacheReleasedPages == stats._pageCachePages);
+}
+
+// 所有thread cache中缓存的字节数
+static size_t ThreadCacheBytes()
+{
+	AllocatorStats stats = GetAllocatorStats();
+	size_t bytes = 0;
+	for (size_t i = 0; i < N_FREELISTS; ++i)
+	{
+		bytes += stats._classes[i]._threadCacheObjs * stats._classes[i]._objSize;
+	}
+	return bytes;
+}
+
+// 申请n个大小在[1KB, 4KB]之间的内存块再全部释放，释放的内存块留在thread cache中
+static void Churn(size_t n)
+{
+	std::vector<void*> ptrs;
+	for (size_t i = 0; i < n; ++i) ptrs.push_back(ConcurrentAlloc(1024 + i % 32 * 1024));
+	for (void* ptr : ptrs) ConcurrentFree(ptr);
+}
+
+// 几个线程的thread cache缓存了大量内存块时调小总预算：各线程之后释放内存时超过容量上限，
+// 把多占的容量还给预算并归还内存块，所有thread cache缓存的总字节数降到新的预算以下
+static void TestThreadCacheBudget()
+{
+#ifdef CMP_PER_CPU_CACHE
+	// 每CPU缓存时线程不各自持有thread cache
+	if (CpuCache::GetInstance()->Enabled()) return;
+#endif
+
+	const size_t nthreads = 4;
+	const size_t budget = 4 * 1024 * 1024;
+	size_t oldBudget = GetThreadCacheBudget();
+
+	std::atomic<size_t> ready{ 0 };
+	std::atomic<int> step{ 0 };
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < nthreads; ++t)
+	{
+		threads.emplace_back([&]() {
+			for (int i = 0; i < 20; ++i) Churn(2000);
+			++ready;
+			while (step != 1) std::this_thread::yield();
+
+			for (int i = 0; i < 20; ++i) Churn(500);
+			++ready;
+			while (step != 2) std::this_thread::yield();
+		});
+	}
+
+	while (ready != nthreads) std::this_thread::yield();
+	CHECK(ThreadCacheBytes() > budget);
+
+	SetThreadCacheBudget(budget);
+	step = 1;
+	for (int i = 0; i < 20; ++i) Churn(500);
+	while (ready != 2 * nthreads) std::this_thread::yield();
+
+	// 线程都还活着，缓存仍在，不是因为线程退出才降下来的
+	CHECK(ThreadCacheBytes() <= budget);
+
+	step = 2;
+	for (auto& th : threads) th.join();
+	SetThreadCacheBudget(oldBudget);
+}
+
+// 后台回收线程：释放的页在空闲超过间隔后被归还，停止时等待线程退出，停止后可以重新启动
+static void TestPageScavenger()
+{
+	std::vector<void*> ptrs(64);
+	for (auto& ptr : ptrs) ptr = ConcurrentAlloc(300 * 1024);
+	for (auto& ptr : ptrs) ConcurrentFree(ptr);
+
+	size_t released = GetAllocatorStats()._pageCacheReleasedPages;
+
+	StartPageScavenger(10);
+	StartPageScavenger(20); // 重复启动只更新间隔
+	for (int i = 0; i < 200 && GetAllocatorStats()._pageCacheReleasedPages <= released; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	CHECK(GetAllocatorStats()._pageCacheReleasedPages > released);
+	StopPageScavenger();
+
+	StartPageScavenger(1000);
+	StopPageScavenger(); // 不用等到下一次回收
+	StopPageScavenger();
+}
+
+struct alignas(64) CacheLine
+{
+	char _data[40];
+};
+
+// STL分配器和pmr内存资源
+static void TestAllocator()
+{
+	std::vector<int, ConcurrentAllocator<int>> v;
+	for (int i = 0; i < 100000; ++i) v.push_back(i);
+	CHECK(v[99999] == 99999);
+
+	std::map<int, std::string, std::less<int>, ConcurrentAllocator<std::pair<const int, std::string>>> m;
+	for (int i = 0; i < 1000; ++i) m[i] = std::to_string(i);
+	CHECK(m[500] == "500");
+
+	std::vector<CacheLine, ConcurrentAllocator<CacheLine>> lines(33);
+	for (auto& line : lines) CHECK(((uintptr_t)&line & 63) == 0);
+
+	CHECK(ConcurrentAllocator<int>() == ConcurrentAllocator<char>());
+
+#ifdef CMP_HAS_MEMORY_RESOURCE
+	std::pmr::memory_resource* resource = ConcurrentMemoryResource::GetInstance();
+	std::pmr::vector<std::pmr::string> strs(resource);
+	for (int i = 0; i < 1000; ++i) strs.emplace_back(std::string(i % 100, 'x'));
+	CHECK(strs[999].size() == 99);
+
+	void* page = resource->allocate(0, (size_t)1 << (PAGE_SHIFT + 2));
+	CHECK(((uintptr_t)page & (((size_t)1 << (PAGE_SHIFT + 2)) - 1)) == 0);
+	resource->deallocate(page, 0, (size_t)1 << (PAGE_SHIFT + 2));
+
+	ConcurrentMemoryResource other;
+	CHECK(resource->is_equal(other));
+#endif
+}
+
+// unit_test_other.cpp中定义
+std::vector<int, ConcurrentAllocator<int>> OtherUnitVector(size_t n);
+void OtherUnitFree(void* ptr);
+ThreadCache* OtherUnitThreadCache();
+ConcurrentObjectPool<Span>* OtherUnitSpanPool();
+PageScavenger* OtherUnitPageScavenger();
+
+// 内存池的头文件被两个编译单元包含：两边共用同一套单例和线程局部的ThreadCache，一边申请的内存在另一边释放
+static void TestTwoUnits()
+{
+	std::vector<int, ConcurrentAllocator<int>> v = OtherUnitVector(1000);
+	CHECK(v.size() == 1000 && v[999] == 999);
+	CHECK(OtherUnitThreadCache() == pTLSThreadCache);
+	CHECK(OtherUnitSpanPool() == SpanPool());
+	CHECK(OtherUnitPageScavenger() == GetPageScavenger());
+
+	OtherUnitFree(ConcurrentAlloc(100));
+	OtherUnitFree(ConcurrentAlloc(MAX_BYTES + 1));
+
+	std::thread([]() {
+		void* ptr = ConcurrentAlloc(64);
+		CHECK(OtherUnitThreadCache() == pTLSThreadCache);
+		OtherUnitFree(ptr);
+	}).join();
+}
+
+#ifdef __linux__
+// 内存池的单例在第一次使用时读取环境，这类用例在子进程中执行setup（设置环境变量等）后重新执行unit_test，
+// argv[1]为mode，main据此只运行对应的用例，返回子进程是否全部通过
+template<class F>
+static bool RunInNewProcess(const char* mode, F setup)
+{
+	fflush(stderr);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		setup();
+		execl("/proc/self/exe", "unit_test", mode, (char*)nullptr);
+		_exit(127);
+	}
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// 在CMP_NUMA_TOPOLOGY描述的假两节点拓扑下运行（见TestNuma）：当前CPU属于节点1，其余CPU属于节点0
+// 申请的内存要来自当前节点的central cache和这个节点的page heap分片，指定节点时走指定节点
+static void TestNumaChild()
+{
+	NumaTopology* topo = NumaTopology::GetInstance();
+	CHECK(topo->IsFake() && topo->NumNodes() == 2);
+	CHECK(topo->CurrentNode() == 1);
+	CHECK(CentralCache::GetInstance(0) != CentralCache::GetInstance(1));
+
+	// 两个节点平分page heap的分片
+	const size_t shardsPerNode = PAGE_HEAP_SHARDS / 2;
+
+	void* small = ConcurrentAlloc(64);
+	Span* span = PageCache::GetInstance()->MapObjToSpan(small);
+	CHECK(span->_node == 1 && span->_shard / shardsPerNode == 1);
+
+	void* big = ConcurrentAlloc(MAX_BYTES + 1);
+	CHECK(PageCache::GetInstance()->MapObjToSpan(big)->_shard / shardsPerNode == 1);
+
+	for (size_t node = 0; node < 2; ++node)
+	{
+		void* start = nullptr;
+		void* end = nullptr;
+		size_t n = CentralCache::GetInstance(node)->FetchRangeObj(start, end, 4, 64);
+		CHECK(n > 0);
+		span = PageCache::GetInstance()->MapObjToSpan(start);
+		CHECK(span->_node == node && span->_shard / shardsPerNode == node);
+		CentralCache::GetInstance(node)->ReleaseRangeObj(start, end, n, 64);
+
+		Span* pages = PageCache::GetInstance()->GetSpan(1, node);
+		CHECK(pages != nullptr && pages->_shard / shardsPerNode == node);
+		PageCache::GetInstance()->ReleaseSpanToPageCache(pages);
+	}
+
+	ConcurrentFree(small);
+	ConcurrentFree(big);
+}
+
+// 拓扑在第一次使用内存池时读取，在新进程中运行TestNumaChild
+// 进程先固定到当前CPU上，假拓扑把这个CPU分给节点1
+static void TestNuma()
+{
+	CHECK(RunInNewProcess("numa", [] {
+		int cpu = sched_getcpu();
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+
+		char spec[64];
+		snprintf(spec, sizeof(spec), "0-%zu;%d", MAX_CPUS - 1, cpu);
+		setenv("CMP_NUMA_TOPOLOGY", spec, 1);
+	}));
+}
+
+#ifdef CMP_PER_CPU_CACHE
+// glibc为线程注册了rseq时启用每CPU缓存，小块内存不经过线程局部的ThreadCache；
+// 没有rseq时退回到ThreadCache，两种情况下申请释放都要正常工作
+static void TestPerCpuCacheChild()
+{
+	bool rseq = false;
+#ifdef CMP_HAVE_RSEQ
+	rseq = __rseq_size != 0;
+#endif
+	CHECK(CpuCache::GetInstance()->Enabled() == rseq);
+
+	std::thread([rseq]() {
+		std::vector<void*> ptrs;
+		for (size_t i = 0; i < 2000; ++i)
+		{
+			ptrs.push_back(ConcurrentAlloc(i % 1024 + 1));
+			Fill(ptrs[i], i % 1024 + 1, (unsigned char)i);
+		}
+		CHECK((pTLSThreadCache == nullptr) == rseq);
+
+		for (size_t i = 0; i < ptrs.size(); ++i)
+		{
+			CHECK(Verify(ptrs[i], i % 1024 + 1, (unsigned char)i));
+			ConcurrentFree(ptrs[i]);
+		}
+	}).join();
+}
+
+// 本进程按glibc的默认设置运行，再在用GLIBC_TUNABLES关闭了rseq的新进程中运行一遍，走退回ThreadCache的路径
+static void TestPerCpuCache()
+{
+	TestPerCpuCacheChild();
+	CHECK(RunInNewProcess("norseq", [] {
+		setenv("GLIBC_TUNABLES", "glibc.pthread.rseq=0", 1);
+	}));
+}
+#endif
+#endif
+
+#ifdef CMP_HEAP_PROFILER
+// 导出heap profile并解析：返回头部记录的存活采样数，格式不对时返回-1
+static long DumpAndCountSamples()
+{
+	char path[] = "/tmp/cmp_heap_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) return -1;
+	close(fd);
+
+	long samples = -1;
+	if (HeapProfiler::GetInstance()->DumpHeapProfile(path))
+	{
+		std::string text;
+		FILE* fp = fopen(path, "r");
+		char buf[4096];
+		size_t len = 0;
+		while (fp && (len = fread(buf, 1, sizeof(buf), fp)) > 0) text.append(buf, len);
+		if (fp) fclose(fp);
+
+		// 头部"heap profile: 存活采样数: 字节数 [...] @ heap_v2/采样间隔"，每个采样一行，最后是进程的内存映射
+		size_t bytes = 0;
+		long lines = 0;
+		for (size_t pos = text.find('\n'); pos != std::string::npos && text.compare(pos + 1, 1, "\n") != 0; pos = text.find('\n', pos + 1)) ++lines;
+		if (sscanf(text.c_str(), "heap profile: %ld: %zu", &samples, &bytes) != 2
+			|| text.find("@ heap_v2/") == std::string::npos
+			|| text.find("\nMAPPED_LIBRARIES:\n") == std::string::npos
+			|| lines != samples)
+		{
+			samples = -1;
+		}
+	}
+
+	unlink(path);
+	return samples;
+}
+
+// 堆分析：申请足够多的内存触发采样，释放一半后导出的profile中存活的采样减少但不为0
+static void TestHeapProfiler()
+{
+	size_t rate = HeapProfiler::GetInstance()->GetSampleRate();
+	HeapProfiler::GetInstance()->SetSampleRate(64 * 1024);
+
+	// 4MB，平均约60次采样
+	std::vector<void*> ptrs;
+	for (size_t i = 0; i < 4000; ++i) ptrs.push_back(ConcurrentAlloc(1000));
+
+	long before = DumpAndCountSamples();
+	CHECK(before > 0);
+
+	for (size_t i = 0; i < ptrs.size(); i += 2) ConcurrentFree(ptrs[i]);
+
+	long after = DumpAndCountSamples();
+	CHECK(after > 0 && after < before);
+
+	for (size_t i = 1; i < ptrs.size(); i += 2) ConcurrentFree(ptrs[i]);
+	HeapProfiler::GetInstance()->SetSampleRate(rate);
+}
+#endif
+
+#ifdef CMP_HARDENED
+// 在子进程中执行f，检查子进程是否因为检测到堆错误而abort
+template<class F>
+static bool Aborts(F f)
+{
+	fflush(stderr);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		// 子进程的错误输出是预期的，不打印到测试结果里
+		int fd = open("/dev/null", O_WRONLY);
+		dup2(fd, 2);
+		f();
+		_exit(0);
+	}
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+// 加固模式：重复释放、写越界、释放非法指针都要立即abort
+static void TestHardened()
+{
+	CHECK(Aborts([] {
+		void* ptr = ConcurrentAlloc(32);
+		ConcurrentFree(ptr);
+		ConcurrentFree(ptr);
+	}));
+
+	CHECK(Aborts([] {
+		void* ptrs[4];
+		ConcurrentAllocBatch(64, 4, ptrs);
+		ptrs[3] = ptrs[1];
+		ConcurrentFreeBatch(ptrs, 4);
+	}));
+
+	CHECK(Aborts([] {
+		char* ptr = (char*)ConcurrentAlloc(24);
+		memset(ptr, 0, ConcurrentUsableSize(ptr) + 1);
+		ConcurrentFree(ptr);
+	}));
+
+	CHECK(Aborts([] {
+		char* ptr = (char*)ConcurrentAlloc(64);
+		ConcurrentFree(ptr + 8);
+	}));
+
+	CHECK(Aborts([] {
+		static char buffer[64];
+		ConcurrentFree(buffer);
+	}));
+
+	CHECK(Aborts([] {
+		void* ptr = ConcurrentAlloc(100);
+		ConcurrentFree(ptr, 2000);
+	}));
+
+	CHECK(Aborts([] {
+		void* ptr = ConcurrentAlloc(1024 * 1024);
+		ConcurrentFree(ptr);
+		ConcurrentFree(ptr);
+	}));
+
+	// 正常的申请释放不会被误报
+	CHECK(!Aborts([] {
+		void* ptr = ConcurrentAlloc(24);
+		memset(ptr, 0, ConcurrentUsableSize(ptr));
+		ConcurrentFree(ptr, 24);
+	}));
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+#ifdef __linux__
+	// RunInNewProcess启动的子进程
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "numa") == 0) TestNumaChild();
+#ifdef CMP_PER_CPU_CACHE
+		if (strcmp(argv[1], "norseq") == 0)
+		{
+#ifdef CMP_HAVE_RSEQ
+			CHECK(__rseq_size == 0);
+#endif
+			TestPerCpuCacheChild();
+		}
+#endif
+		return failures > 0 ? 1 : 0;
+	}
+#endif
+
+	TestAllocFree();
+	TestSizedFree();
+	TestAligned();
+	TestRealloc();
+	TestBatch();
+	TestCrossThread();
+	TestObjectPoolContention();
+	TestObjectPoolThreadExit();
+	TestObjectPoolSlotReuse();
+	TestTransferCache();
+	TestSpanRoundTrip();
+	TestRemoteFree();
+	TestReleaseFreeMemory();
+	TestPageScavenger();
+	TestThreadCacheBudget();
+	TestAllocator();
+	TestTwoUnits();
+#ifdef __linux__
+	TestNuma();
+#ifdef CMP_PER_CPU_CACHE
+	TestPerCpuCache();
+#endif
+#endif
+#ifdef CMP_HEAP_PROFILER
+	TestHeapProfiler();
+#endif
+#ifdef CMP_HARDENED
+	TestHardened();
+#endif
+
+	if (failures > 0)
+	{
+		fprintf(stderr, "%d个检查失败\n", failures);
+		return 1;
+	}
+
+	printf("所有测试通过\n");
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#include "ConcurrentAllocator.hpp"
+#include <vector>
+
+// unit_test的第二个编译单元：内存池的头文件被多个编译单元包含时要能正常链接，
+// 并且所有编译单元共用同一个内存池，一个线程在两边看到的是同一个ThreadCache
+
+// 在这个编译单元中申请，由unit_test.cpp释放
+std::vector<int, ConcurrentAllocator<int>> OtherUnitVector(size_t n)
+{
+	std::vector<int, ConcurrentAllocator<int>> v;
+	for (size_t i = 0; i < n; ++i) v.push_back((int)i);
+	return v;
+}
+
+// 释放unit_test.cpp中申请的内存
+void OtherUnitFree(void* ptr)
+{
+	ConcurrentFree(ptr);
+}
+
+ThreadCache* OtherUnitThreadCache()
+{
+	return pTLSThreadCache;
+}
+
+ConcurrentObjectPool<Span>* OtherUnitSpanPool()
+{
+	return SpanPool();
+}
+
+PageScavenger* OtherUnitPageScavenger()
+{
+	return GetPageScavenger();
+}
\ No newline at end of file
@@ -9,6 +9,17 @@
 #include <mutex>
 #include <unordered_map>
 
+#ifdef USE_CONCURRENT_MEMORY_POOL
+#include "../../ConcurrentMemoryPool/ConcurrentAllocator.hpp"
+
+// 房间随对局开始和结束频繁创建销毁，房间管理哈希表的节点从内存池申请
+template<class K, class V>
+using room_map = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, ConcurrentAllocator<std::pair<const K, V>>>;
+#else
+template<class K, class V>
+using room_map = std::unordered_map<K, V>;
+#endif
+
 #define BOARD_ROWS 15
 #define BOARD_COLS 15
 #define CHESS_WHITE 1
@@ -454,6 +465,6 @@ private:
     std::mutex _mtx;                                       // 互斥锁
     user_table* _user_tb;                                  // 数据管理模块句柄
     online_manager* _user_ol;                              // 在线用户管理模块句柄
-    std::unordered_map<uint64_t, room_ptr> _roomId_room;   // 房间id与房间信息的关联关系
-    std::unordered_map<uint64_t, uint64_t> _userId_roomId; // 用户id与房间id的关联关系
+    room_map<uint64_t, room_ptr> _roomId_room;             // 房间id与房间信息的关联关系
+    room_map<uint64_t, uint64_t> _userId_roomId;           // 用户id与房间id的关联关系
 };
\ No newline at end of file
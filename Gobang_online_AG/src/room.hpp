@@ -9,6 +9,17 @@
 #include <cstdlib>
 #include <ctime>
 
+#ifdef USE_CONCURRENT_MEMORY_POOL
+#include "../../ConcurrentMemoryPool/ConcurrentAllocator.hpp"
+
+// 房间随对局开始和结束频繁创建销毁，房间管理哈希表的节点从内存池申请
+template<class K, class V>
+using room_map = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, ConcurrentAllocator<std::pair<const K, V>>>;
+#else
+template<class K, class V>
+using room_map = std::unordered_map<K, V>;
+#endif
+
 #include "logger.hpp"
 #include "db.hpp"
 #include "online.hpp"
@@ -468,6 +479,6 @@ private:
     std::mutex _mtx;                                             // 互斥锁
     user_table* _user_table;                                     // 数据库用户信息表的操作句柄
     online_manager* _user_online;                                // 在线用户管理句柄
-    std::unordered_map<uint64_t, room_ptr> _room_id_and_room;    // 游戏房间id和游戏房间的关联关系
-    std::unordered_map<uint64_t, uint64_t> _user_id_and_room_id; // 玩家id和游戏房间id的关联关系
+    room_map<uint64_t, room_ptr> _room_id_and_room;              // 游戏房间id和游戏房间的关联关系
+    room_map<uint64_t, uint64_t> _user_id_and_room_id;           // 玩家id和游戏房间id的关联关系
 };
\ No newline at end of file
@@ -500,8 +500,8 @@ public:
     std::string _version;                                  // 协议版本
     std::string _body;                                     // 请求正文
     std::smatch _match;                                    // 资源路径的正则提取数据
-    std::unordered_map<std::string, std::string> _headers; // 头部字段
-    std::unordered_map<std::string, std::string> _params;  // 查询字符串
+    PoolUnorderedMap<std::string, std::string> _headers;   // 头部字段
+    PoolUnorderedMap<std::string, std::string> _params;    // 查询字符串
 };
 
 class HttpResponse
@@ -587,7 +587,7 @@ public:
     bool _redirect_flag;                                   // 重定向标志
     std::string _body;                                     // 正文
     std::string _redirect_url;                             // 重定向url
-    std::unordered_map<std::string, std::string> _headers; // 头部字段
+    PoolUnorderedMap<std::string, std::string> _headers;   // 头部字段
 };
 
 typedef enum
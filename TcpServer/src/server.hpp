@@ -22,6 +22,22 @@
 #include <signal.h>
 #include <condition_variable>
 
+#ifdef USE_CONCURRENT_MEMORY_POOL
+#include "../../ConcurrentMemoryPool/ObjectPool.hpp"
+#include "../../ConcurrentMemoryPool/ConcurrentAllocator.hpp"
+
+// 缓冲区和哈希表随连接、请求反复创建销毁，改为从内存池申请，释放时带大小走线程缓存的快速路径
+template<class T>
+using PoolVector = std::vector<T, ConcurrentAllocator<T>>;
+template<class K, class V>
+using PoolUnorderedMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, ConcurrentAllocator<std::pair<const K, V>>>;
+#else
+template<class T>
+using PoolVector = std::vector<T>;
+template<class K, class V>
+using PoolUnorderedMap = std::unordered_map<K, V>;
+#endif
+
 // 日志宏
 #define INF 0
 #define DBG 1
@@ -220,7 +236,7 @@ public:
     }
 
 private:
-    std::vector<char> _buffer; // 使用vector进行内存管理
+    PoolVector<char> _buffer;  // 使用vector进行内存管理
     uint64_t _read_index;      // 读偏移
     uint64_t _write_index;     // 写偏移
 };
@@ -652,12 +668,30 @@ private:
 private:
     int _epfd;
     struct epoll_event _evs[MAX_EPOLLEVENTS];
-    std::unordered_map<int, Channel*> _channels; // 文件描述符和其对应的channel对象的关联关系
+    PoolUnorderedMap<int, Channel*> _channels; // 文件描述符和其对应的channel对象的关联关系
 };
 
 using TaskFunc = std::function<void()>;
 using ReleaseFunc = std::function<void()>;
 
+#ifdef USE_CONCURRENT_MEMORY_POOL
+// 定时任务和连接对象创建销毁频繁，从线程安全的定长内存池中申请，对象可以在任意线程释放
+// 内存池在进程退出时不析构，避免静态对象析构时还有对象没有归还
+template<class T>
+ConcurrentObjectPool<T>* PoolOf()
+{
+    static ConcurrentObjectPool<T>* pool = new ConcurrentObjectPool<T>;
+    return pool;
+}
+
+// 从内存池中构造对象，由shared_ptr管理，引用计数归零时归还给内存池
+template<class T, class... Args>
+std::shared_ptr<T> MakePooled(Args&&... args)
+{
+    return std::shared_ptr<T>(PoolOf<T>()->New(std::forward<Args>(args)...), [](T* obj) { PoolOf<T>()->Delete(obj); });
+}
+#endif
+
 // 定时器任务类
 class TimerTask
 {
@@ -795,7 +829,11 @@ private:
     // 添加定时任务
     void TimerAddInLoop(uint64_t id, uint32_t delay, const TaskFunc& cb)
     {
+#ifdef USE_CONCURRENT_MEMORY_POOL
+        SharedTask st = MakePooled<TimerTask>(id, delay, cb);
+#else
         SharedTask st(new TimerTask(id, delay, cb));
+#endif
         st->SetRelease(std::bind(&TimerWheel::RemoveTimer, this, id));
         _timers[id] = WeakTask(st);
 
@@ -1576,7 +1614,11 @@ private:
     {
         ++_next_id;
 
+#ifdef USE_CONCURRENT_MEMORY_POOL
+        SharedConnection conn = MakePooled<Connection>(_pool.NextLoop(), _next_id, fd);
+#else
         SharedConnection conn(new Connection(_pool.NextLoop(), _next_id, fd));
+#endif
         conn->SetConnectedCallback(_connected_callback);
         conn->SetMessageCallback(_message_callback);
         conn->SetClosedCallback(_closed_callback);